@@ -0,0 +1,498 @@
+/* SPDX-FileCopyrightText: 2021 Pali Rohár <pali@kernel.org> */
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h> /* for read(), close() */
+#include <sys/epoll.h> /* for epoll_*() */
+
+#include <asm/termbits.h> /* for TCIFLUSH */
+
+#include "autodetect.h"
+#include "baudrate.h"
+
+/* Baud rates seen most often in the field, sampled first */
+static const unsigned int common_rates[] = {
+    115200, 9600, 19200, 38400, 57600, 230400, 460800, 921600,
+    4800, 2400, 1200, 1000000, 1500000, 3000000,
+};
+
+/* Window is long enough to receive this many characters */
+#define WINDOW_CHARS 64
+
+/* Bounds of sampling window length in milliseconds */
+#define WINDOW_MIN_MS 20
+#define WINDOW_MAX_MS 200
+
+/* Windows with less received bytes are not scored */
+#define MIN_BYTES 8
+
+/* Stop detection when window reached this score without line errors */
+#define GOOD_SCORE 0.9
+#define GOOD_BYTES 16
+
+static int
+has_rate(const struct autodetect *ad, unsigned int rate)
+{
+    size_t i;
+
+    for (i = 0; i < ad->nrates; i++) {
+        if (ad->rates[i] == rate)
+            return 1;
+    }
+
+    return 0;
+}
+
+static void
+add_rate(struct autodetect *ad, unsigned int rate)
+{
+    if (rate != 0 && ad->nrates < AUTODETECT_MAX_RATES && !has_rate(ad, rate))
+        ad->rates[ad->nrates++] = rate;
+}
+
+/* Custom rates first, then common ones, then remaining standard rates
+   from the highest as those have shortest sampling window */
+static void
+order_rates(struct autodetect *ad, const unsigned int *custom, size_t ncustom)
+{
+    const unsigned int *standard;
+    size_t i, j, nstandard;
+
+    nstandard = baudrate_list_standard(&standard);
+
+    for (i = 0; i < ncustom; i++)
+        add_rate(ad, custom[i]);
+
+    for (i = 0; i < sizeof(common_rates)/sizeof(common_rates[0]); i++) {
+        for (j = 0; j < nstandard; j++) {
+            if (standard[j] == common_rates[i])
+                add_rate(ad, common_rates[i]);
+        }
+    }
+
+    for (i = nstandard; i > 0; i--)
+        add_rate(ad, standard[i-1]);
+}
+
+/* Likelihood that byte was received at correct baud rate, wrong baud rate
+   produces mostly NUL (framing error), 0xff and random binary data */
+static double
+plausibility(unsigned char c)
+{
+    if (c == 0x00 || c == 0xff)
+        return 0;
+    if ((c >= 0x20 && c < 0x7f) || c == '\r' || c == '\n' || c == '\t')
+        return 1;
+    return 0.5;
+}
+
+static int
+start_window(struct autodetect *ad)
+{
+    double ms;
+
+    ad->rate = ad->rates[ad->next++];
+    ad->bytes = 0;
+    ad->weight = 0;
+
+    if (baudrate_set(ad->fd, ad->rate, ad->rate))
+        return -1;
+    if (baudrate_flush(ad->fd, TCIFLUSH))
+        return -1;
+
+    /* Line error counters are optional, not every driver provides them */
+    ad->have_icount = !baudrate_get_icount(ad->fd, &ad->icount);
+
+    ms = WINDOW_CHARS * 10 * 1000.0 / ad->rate;
+    if (ms < WINDOW_MIN_MS)
+        ms = WINDOW_MIN_MS;
+    else if (ms > WINDOW_MAX_MS)
+        ms = WINDOW_MAX_MS;
+    ad->deadline = tio_now() + ms / 1000;
+    return 0;
+}
+
+static void
+finish_window(struct autodetect *ad)
+{
+    struct serial_icounter_struct icount;
+    unsigned long errors = 0;
+    double score = 0;
+
+    if (ad->have_icount && !baudrate_get_icount(ad->fd, &icount))
+        errors = (icount.frame - ad->icount.frame) +
+                 (icount.parity - ad->icount.parity) +
+                 (icount.brk - ad->icount.brk);
+
+    /* Every line error weights more than one implausible byte */
+    if (ad->bytes >= MIN_BYTES)
+        score = ad->weight / (ad->bytes + 4 * errors);
+
+    if (score > ad->best_score) {
+        ad->best_score = score;
+        ad->best_rate = ad->rate;
+        ad->best_bytes = ad->bytes;
+    }
+
+    if ((score >= GOOD_SCORE && errors == 0 && ad->bytes >= GOOD_BYTES) ||
+        ad->next >= ad->nrates)
+        ad->done = 1;
+}
+
+int
+autodetect_begin(struct autodetect *ad, int fd,
+                 const unsigned int *custom, size_t ncustom)
+{
+    memset(ad, 0, sizeof(*ad));
+    ad->fd = fd;
+    ad->start = tio_now();
+
+    order_rates(ad, custom, ncustom);
+    if (!ad->nrates) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (tio_set_raw(fd, &ad->saved))
+        return -1;
+
+    if (start_window(ad)) {
+        tio_set(fd, &ad->saved);
+        return -1;
+    }
+
+    return 0;
+}
+
+int
+autodetect_input(struct autodetect *ad)
+{
+    unsigned char buf[256];
+    ssize_t len, i;
+
+    for (;;) {
+        len = read(ad->fd, buf, sizeof(buf));
+        if (len < 0 && errno == EINTR)
+            continue;
+        if ((len < 0 && errno == EAGAIN) || len == 0)
+            break;
+        if (len < 0)
+            return -1;
+        for (i = 0; i < len; i++)
+            ad->weight += plausibility(buf[i]);
+        ad->bytes += len;
+    }
+
+    /* Enough data for this window, no need to wait for its deadline */
+    if (ad->bytes >= WINDOW_CHARS)
+        return autodetect_timeout(ad);
+
+    return 0;
+}
+
+int
+autodetect_timeout(struct autodetect *ad)
+{
+    finish_window(ad);
+    if (ad->done)
+        return 0;
+
+    return start_window(ad);
+}
+
+int
+autodetect_end(struct autodetect *ad, struct autodetect_result *res)
+{
+    res->rate = ad->best_rate;
+    res->score = ad->best_score;
+    res->bytes = ad->best_bytes;
+    res->tried = ad->next;
+    res->seconds = tio_now() - ad->start;
+
+    /* Restore original settings including baud rate when nothing was
+       detected, otherwise switch to the detected baud rate */
+    if (tio_set(ad->fd, &ad->saved))
+        return -1;
+    if (ad->best_rate && baudrate_set(ad->fd, ad->best_rate, ad->best_rate))
+        return -1;
+
+    return 0;
+}
+
+/*
+ * Timer wheel scheduling sampling window deadlines of all active ports.
+ * Slot cur corresponds to time base, every following slot is one tick
+ * later. Deadlines further than whole wheel are parked in the last slot
+ * and re-inserted when it is reached.
+ */
+#define WHEEL_SLOTS 64
+#define WHEEL_TICK (5 / 1000.0)
+
+struct wheel {
+    double base;
+    size_t cur;
+    long head[WHEEL_SLOTS];
+    long *next; /* per port links, -1 terminates list */
+    long *prev;
+    long *slot; /* -1 when port is not scheduled */
+};
+
+static int
+wheel_init(struct wheel *w, size_t count)
+{
+    size_t i;
+
+    w->base = tio_now();
+    w->cur = 0;
+    for (i = 0; i < WHEEL_SLOTS; i++)
+        w->head[i] = -1;
+
+    w->next = malloc(3 * count * sizeof(long));
+    if (!w->next)
+        return -1;
+    w->prev = w->next + count;
+    w->slot = w->prev + count;
+    for (i = 0; i < count; i++)
+        w->slot[i] = -1;
+
+    return 0;
+}
+
+static void
+wheel_remove(struct wheel *w, long i)
+{
+    if (w->slot[i] < 0)
+        return;
+
+    if (w->prev[i] >= 0)
+        w->next[w->prev[i]] = w->next[i];
+    else
+        w->head[w->slot[i]] = w->next[i];
+    if (w->next[i] >= 0)
+        w->prev[w->next[i]] = w->prev[i];
+    w->slot[i] = -1;
+}
+
+static void
+wheel_insert(struct wheel *w, long i, double deadline)
+{
+    double ticks;
+    long slot;
+
+    wheel_remove(w, i);
+
+    /* Slot is processed at its time, so round up and never use current */
+    ticks = (deadline - w->base) / WHEEL_TICK;
+    if (ticks < 1)
+        ticks = 1;
+    else if (ticks > WHEEL_SLOTS - 1)
+        ticks = WHEEL_SLOTS - 1;
+    slot = (w->cur + (size_t)(ticks + 0.999999)) % WHEEL_SLOTS;
+
+    w->slot[i] = slot;
+    w->prev[i] = -1;
+    w->next[i] = w->head[slot];
+    if (w->head[slot] >= 0)
+        w->prev[w->head[slot]] = i;
+    w->head[slot] = i;
+}
+
+/* State of autodetect_run_many() */
+struct scheduler {
+    struct autodetect *ads;
+    const int *fds;
+    size_t count;
+    const unsigned int *custom;
+    size_t ncustom;
+    size_t max_active;
+    size_t active;
+    size_t started;
+    size_t finished;
+    struct wheel wheel;
+    int epfd;
+    autodetect_done_fn done;
+    void *ctx;
+};
+
+static void
+sched_finish(struct scheduler *s, size_t i, int rc)
+{
+    struct autodetect_result res;
+    int err = errno;
+
+    memset(&res, 0, sizeof(res));
+    wheel_remove(&s->wheel, i);
+    epoll_ctl(s->epfd, EPOLL_CTL_DEL, s->fds[i], NULL);
+    if (autodetect_end(&s->ads[i], &res) && !rc) {
+        rc = -1;
+        err = errno;
+    }
+
+    s->active--;
+    s->finished++;
+    errno = err;
+    s->done(s->ctx, i, rc, &res);
+}
+
+/* Start new ports while below concurrency cap */
+static void
+sched_fill(struct scheduler *s)
+{
+    struct autodetect_result res;
+    struct epoll_event ev;
+    size_t i;
+
+    while (s->active < s->max_active && s->started < s->count) {
+        i = s->started++;
+        if (autodetect_begin(&s->ads[i], s->fds[i], s->custom, s->ncustom)) {
+            memset(&res, 0, sizeof(res));
+            s->finished++;
+            s->done(s->ctx, i, -1, &res);
+            continue;
+        }
+
+        s->active++;
+        ev.events = EPOLLIN;
+        ev.data.u64 = i;
+        if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, s->fds[i], &ev)) {
+            sched_finish(s, i, -1);
+            continue;
+        }
+        wheel_insert(&s->wheel, i, s->ads[i].deadline);
+    }
+}
+
+/* Port advanced to the next window or finished, update its schedule */
+static void
+sched_update(struct scheduler *s, size_t i, int rc)
+{
+    if (rc || s->ads[i].done)
+        sched_finish(s, i, rc);
+    else
+        wheel_insert(&s->wheel, i, s->ads[i].deadline);
+}
+
+/* Move wheel up to current time and expire due windows */
+static void
+sched_tick(struct scheduler *s)
+{
+    struct wheel *w = &s->wheel;
+    double t = tio_now();
+    long i, next;
+
+    while (w->base + WHEEL_TICK <= t) {
+        w->cur = (w->cur + 1) % WHEEL_SLOTS;
+        w->base += WHEEL_TICK;
+
+        /* Detach list as expired entries are re-inserted into wheel */
+        i = w->head[w->cur];
+        w->head[w->cur] = -1;
+        for (; i >= 0; i = next) {
+            next = w->next[i];
+            w->slot[i] = -1;
+            if (s->ads[i].deadline <= w->base)
+                sched_update(s, i, autodetect_timeout(&s->ads[i]));
+            else
+                wheel_insert(w, i, s->ads[i].deadline);
+        }
+    }
+}
+
+int
+autodetect_run_many(const int *fds, size_t count,
+                    const unsigned int *custom, size_t ncustom,
+                    size_t max_active, autodetect_done_fn done, void *ctx)
+{
+    struct epoll_event events[64];
+    struct scheduler s;
+    int n, j, timeout;
+    size_t i;
+
+    memset(&s, 0, sizeof(s));
+    s.fds = fds;
+    s.count = count;
+    s.custom = custom;
+    s.ncustom = ncustom;
+    s.max_active = max_active ? max_active : 1;
+    s.done = done;
+    s.ctx = ctx;
+
+    s.ads = malloc(count * sizeof(*s.ads));
+    if (!s.ads)
+        return -1;
+    if (wheel_init(&s.wheel, count)) {
+        free(s.ads);
+        return -1;
+    }
+    s.epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (s.epfd < 0) {
+        free(s.wheel.next);
+        free(s.ads);
+        return -1;
+    }
+
+    sched_fill(&s);
+    while (s.finished < count) {
+        timeout = (int)((s.wheel.base + WHEEL_TICK - tio_now()) * 1000 + 1);
+        if (timeout < 0)
+            timeout = 0;
+
+        n = epoll_wait(s.epfd, events, sizeof(events)/sizeof(events[0]), timeout);
+        if (n < 0 && errno != EINTR)
+            break;
+
+        for (j = 0; j < n; j++) {
+            i = events[j].data.u64;
+            if (s.wheel.slot[i] < 0)
+                continue; /* already finished in this round */
+            sched_update(&s, i, autodetect_input(&s.ads[i]));
+        }
+
+        sched_tick(&s);
+        sched_fill(&s);
+    }
+
+    /* Only epoll_wait() failure can leave some ports unfinished */
+    for (i = 0; i < count; i++) {
+        if (s.wheel.slot[i] >= 0)
+            sched_finish(&s, i, -1);
+    }
+
+    close(s.epfd);
+    free(s.wheel.next);
+    free(s.ads);
+    return s.finished == count ? 0 : -1;
+}
+
+struct single {
+    int rc;
+    int err;
+    struct autodetect_result *res;
+};
+
+static void
+single_done(void *ctx, size_t index, int rc, const struct autodetect_result *res)
+{
+    struct single *single = ctx;
+
+    (void)index;
+    single->rc = rc;
+    single->err = errno;
+    *single->res = *res;
+}
+
+int
+autodetect_run(int fd, const unsigned int *custom, size_t ncustom,
+               struct autodetect_result *res)
+{
+    struct single single = { 0, 0, res };
+
+    if (autodetect_run_many(&fd, 1, custom, ncustom, 1, single_done, &single))
+        return -1;
+
+    errno = single.err;
+    return single.rc;
+}
@@ -0,0 +1,87 @@
+/* SPDX-FileCopyrightText: 2021 Pali Rohár <pali@kernel.org> */
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+#ifndef AUTODETECT_H
+#define AUTODETECT_H
+
+#include <stddef.h> /* for size_t */
+
+#include <linux/serial.h> /* for struct serial_icounter_struct */
+
+#include "tio.h"
+
+/* Upper limit of candidate baud rates, standard and custom ones */
+#define AUTODETECT_MAX_RATES 64
+
+/*
+ * Auto-baud detection state of one port. Port is sampled at one candidate
+ * baud rate for a short window and received bytes and line errors are
+ * scored. Detection is driven by autodetect_input() when port is readable
+ * and autodetect_timeout() when deadline expires, so multiple ports can be
+ * multiplexed by one event loop.
+ */
+struct autodetect {
+    int fd;
+    int done; /* set when no more candidate baud rates will be sampled */
+    double deadline; /* tio_now() time when current window ends */
+
+    /* Candidate baud rates in order in which they are sampled */
+    unsigned int rates[AUTODETECT_MAX_RATES];
+    size_t nrates;
+    size_t next;
+
+    /* Current sampling window */
+    unsigned int rate;
+    unsigned long bytes;
+    double weight; /* sum of plausibility of received bytes */
+    struct serial_icounter_struct icount;
+    int have_icount;
+
+    /* Best candidate so far */
+    unsigned int best_rate; /* 0 when nothing was detected */
+    double best_score;
+    unsigned long best_bytes;
+
+    double start;
+    tio_t saved;
+};
+
+/* Result of auto-baud detection */
+struct autodetect_result {
+    unsigned int rate; /* 0 when baud rate was not detected */
+    double score; /* 0 to 1, higher is better */
+    unsigned long bytes; /* bytes received at detected baud rate */
+    unsigned int tried; /* number of sampled baud rates */
+    double seconds;
+};
+
+/* Switch port to raw mode and start sampling at the first candidate, custom
+   baud rates are tried before standard ones. Return 0 or -1 with errno */
+int autodetect_begin(struct autodetect *ad, int fd,
+                     const unsigned int *custom, size_t ncustom);
+
+/* Consume bytes available on port */
+int autodetect_input(struct autodetect *ad);
+
+/* Finish current window and move to the next candidate */
+int autodetect_timeout(struct autodetect *ad);
+
+/* Restore port settings and configure the detected baud rate */
+int autodetect_end(struct autodetect *ad, struct autodetect_result *res);
+
+/* Called from autodetect_run_many() as soon as port index finished, rc is
+   0 on success or -1 with errno set */
+typedef void (*autodetect_done_fn)(void *ctx, size_t index, int rc,
+                                   const struct autodetect_result *res);
+
+/* Run detection concurrently on count ports from one epoll loop with at
+   most max_active ports being sampled at the same time */
+int autodetect_run_many(const int *fds, size_t count,
+                        const unsigned int *custom, size_t ncustom,
+                        size_t max_active, autodetect_done_fn done, void *ctx);
+
+/* Run whole detection for a single port */
+int autodetect_run(int fd, const unsigned int *custom, size_t ncustom,
+                   struct autodetect_result *res);
+
+#endif
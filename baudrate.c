@@ -1,302 +1,2134 @@
 /* SPDX-FileCopyrightText: 2021 Pali Rohár <pali@kernel.org> */
 /* SPDX-License-Identifier: GPL-2.0-or-later */
 
+#define _POSIX_C_SOURCE 200809L /* for getline(), strdup() */
+
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <fcntl.h> /* for open() */
-#include <unistd.h> /* for close() */
+#include <getopt.h> /* for getopt_long() */
+#include <pthread.h> /* for pthread_*() */
+#include <signal.h> /* for sigwait() */
+#include <unistd.h> /* for close(), dup2(), execl() */
+#include <sys/epoll.h> /* for epoll_*() */
+#include <sys/socket.h> /* for socket(), bind(), recv() */
+#include <sys/timerfd.h> /* for timerfd_*() */
 #include <sys/types.h> /* for O_* */
-#include <sys/ioctl.h> /* for ioctl() */
-
-#include <asm/ioctls.h> /* for TCGETS, TCSETS, TCGETS2, TCSETS2, TIOCGSERIAL, TIOCSSERIAL */
-#include <asm/termbits.h> /* for BOTHER, Bnnn, struct termios, struct termios2 */
-#include <linux/serial.h> /* for ASYNC_SPD_*, struct serial_struct */
-
-#define B(n) { B##n, n }
-static struct { tcflag_t bn; unsigned int n; }
-map[] =
-{
-    B(0), B(50), B(75), B(110), B(134), B(150), B(200), B(300), B(600),
-    B(1200), B(1800), B(2400), B(4800), B(9600), B(19200), B(38400),
-    B(57600), B(115200), B(230400), B(460800), B(500000), B(576000),
-    B(921600), B(1000000), B(1152000), B(1500000), B(2000000),
-#ifdef B2500000
-    /* non-SPARC architectures support these Bnnn constants */
-    B(2500000), B(3000000), B(3500000), B(4000000)
-#else
-    /* SPARC architecture supports these Bnnn constants */
-    B(76800), B(153600), B(307200), B(614400)
-#endif
+
+#include <linux/netlink.h> /* for NETLINK_KOBJECT_UEVENT, struct sockaddr_nl */
+#include <linux/serial.h> /* for ASYNC_SPD_* */
+
+#include "autodetect.h"
+#include "baudrate.h"
+#include "bench.h"
+#include "sim.h"
+#include "state.h"
+#include "trace.h"
+#include "udev.h"
+
+/* One device processed by configure_port() */
+struct port {
+    const char *dev;
+    int set; /* non-zero when baud rate should be changed */
+    unsigned int output;
+    unsigned int input;
+    unsigned int target_output; /* passed to library, chosen by --best-fit */
+    unsigned int target_input;
+    /* Filled by configure_port(), raw fields only with machine formats */
+    struct baudrate_info info;
+    long output_ppm; /* error of rate chosen by --best-fit */
+    long input_ppm;
+    long verify_output_ppm; /* difference of read back rate with --verify */
+    long verify_input_ppm;
+    int verified; /* both differences are within tolerance */
+    struct baudrate_opts opts; /* read back when --profile is used */
+    double drain; /* seconds spent by setting with --drain or --flush */
+    struct trace_device trace; /* ioctl timing with --trace-timing */
+    struct baudrate_timing timing; /* of configured rate with --timing */
+    int have_timing; /* zero for B0 or unknown rate */
+    struct baudrate_caps caps; /* probed capabilities from --state file */
+    int have_caps;
+    char error[128];
+    int rc;
+    int done; /* protected by pool.lock when workers are used */
+    int fd; /* kept open by configure_port() when keep_open is set */
+};
+
+/* Worker pool state shared by all threads */
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct port *ports;
+    size_t count;
+    size_t next;
+} pool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, 0, 0 };
+
+/* Output format selected by --format */
+static enum {
+    FORMAT_TEXT,
+    FORMAT_JSON,
+    FORMAT_KV,
+} format = FORMAT_TEXT;
+
+/* Set closest achievable baud rate instead of the requested one */
+static int best_fit;
+
+/* Tolerance in ppm selected by --verify, -1 when not verifying */
+static long verify = -1;
+
+/* Exit status when all devices were set but some is out of tolerance */
+#define EXIT_VERIFY 2
+
+/* Keep fd of configured port open for following mode */
+static int keep_open;
+
+/* Devices are simulated instead of opened, selected by --simulate */
+static int simulate;
+
+/* Report line timing of configured rate, selected by --timing */
+static int show_timing;
+
+/* Time library ioctls, selected by --trace-timing */
+static int trace_timing;
+
+/* Handling of pending data selected by --drain or --flush */
+static int when = BAUDRATE_NOW;
+
+/* Settings selected by --profile, applied together with baud rate */
+static const struct baudrate_opts *profile;
+
+static const struct baudrate_opts profile_lowlatency = {
+    .low_latency = 1,
+    .vmin = 1,
+    .vtime = 0,
+    .latency_timer = 1,
+    .rx_trigger = 1,
+    .rs485_delay = -1,
+};
+
+static const struct baudrate_opts profile_throughput = {
+    .low_latency = 0,
+    .vmin = 255,
+    .vtime = 1,
+    .latency_timer = 16,
+    .rx_trigger = -1, /* driver default is already tuned for throughput */
+    .rs485_delay = -1,
 };
-#undef B
 
-static tcflag_t
-map_n_to_bn(unsigned int n)
+/* Selected profile extended by --rs485-delay */
+static struct baudrate_opts profile_custom;
+
+static int
+port_error(struct port *p, const char *op)
+{
+    snprintf(p->error, sizeof(p->error), "%s: %s", op, strerror(errno));
+    return -1;
+}
+
+static int
+open_device(const char *dev)
+{
+    if (simulate)
+        return sim_open();
+
+    return open(dev, O_RDWR | O_NONBLOCK | O_NOCTTY);
+}
+
+/* Read the current baud rates, including raw values for machine formats */
+static int
+read_info(int fd, struct baudrate_info *info)
+{
+    if (format != FORMAT_TEXT)
+        return baudrate_get_info(fd, info);
+
+    return baudrate_get(fd, &info->output, &info->input);
+}
+
+/* Baud rates which will be set, closest achievable ones with --best-fit */
+static int
+target_rates(struct port *p, int fd, unsigned int *output, unsigned int *input)
+{
+    *output = p->output;
+    *input = p->input;
+    if (best_fit) {
+        if (baudrate_best_fit(fd, p->output, output, &p->output_ppm))
+            return port_error(p, "best fit");
+        if (p->input == p->output) {
+            *input = *output;
+            p->input_ppm = p->output_ppm;
+        } else if (baudrate_best_fit(fd, p->input, input, &p->input_ppm)) {
+            return port_error(p, "best fit");
+        }
+    }
+
+    p->target_output = *output;
+    p->target_input = *input;
+    return 0;
+}
+
+/* Relative difference of rate from requested n, like baudrate_best_fit() */
+static long
+rate_ppm(unsigned int n, unsigned int rate)
+{
+    if (n == 0)
+        return rate == 0 ? 0 : LONG_MAX;
+
+    return ((long long)rate - n) * 1000000 / n;
+}
+
+/* Compare rates passed to library with rates which kernel reported back,
+   so --best-fit is verified against the achievable ones */
+static int
+verify_port(struct port *p)
+{
+    if (p->info.output == BAUDRATE_UNKNOWN || p->info.input == BAUDRATE_UNKNOWN) {
+        snprintf(p->error, sizeof(p->error),
+                 "verify: baud rate cannot be read back");
+        return -1;
+    }
+
+    p->verify_output_ppm = rate_ppm(p->target_output, p->info.output);
+    p->verify_input_ppm = rate_ppm(p->target_input, p->info.input);
+    p->verified = labs(p->verify_output_ppm) <= verify &&
+                  labs(p->verify_input_ppm) <= verify;
+    return 0;
+}
+
+/* Timing of rate which is really configured, not of the requested one */
+static int
+read_timing(struct port *p, int fd)
+{
+    p->have_timing = 0;
+    if (baudrate_get_timing(fd, &p->timing) == 0)
+        p->have_timing = 1;
+    else if (errno != EINVAL)
+        return port_error(p, "get timing");
+
+    return 0;
+}
+
+static int
+configure_fd(struct port *p, int fd)
+{
+    struct baudrate_prepared *prep;
+    unsigned int output, input;
+    int rc;
+
+    if (p->set) {
+        if (target_rates(p, fd, &output, &input))
+            return -1;
+        /* Probed caps tell in advance that driver would refuse the rates */
+        if (p->have_caps && !baudrate_caps_supported(&p->caps, output, input))
+            return port_error(p, "set baud rate");
+        if (baudrate_prepare(fd, output, input, profile, &prep))
+            return port_error(p, "set baud rate");
+        rc = baudrate_commit(prep, when, &p->info.output, &p->info.input);
+        p->drain = baudrate_commit_seconds(prep);
+        baudrate_prepared_free(prep);
+        if (rc)
+            return port_error(p, "set baud rate");
+        if (profile && baudrate_get_opts(fd, &p->opts))
+            return port_error(p, "get profile");
+    }
+
+    if (show_timing && read_timing(p, fd))
+        return -1;
+    if (p->set && format == FORMAT_TEXT)
+        return 0;
+
+    if (read_info(fd, &p->info))
+        return port_error(p, "get baud rate");
+
+    return 0;
+}
+
+static int
+configure_port(struct port *p)
+{
+    int fd, rc;
+
+    fd = open_device(p->dev);
+    if (fd < 0)
+        return port_error(p, "open");
+
+    if (trace_timing && trace_attach(fd, &p->trace)) {
+        close(fd);
+        return port_error(p, "trace");
+    }
+    rc = configure_fd(p, fd);
+    if (trace_timing)
+        trace_detach(fd);
+    if (keep_open && !rc)
+        p->fd = fd;
+    else
+        close(fd);
+    return rc;
+}
+
+static void *
+worker(void *arg)
+{
+    struct port *p;
+    int rc;
+
+    (void)arg;
+
+    for (;;) {
+        pthread_mutex_lock(&pool.lock);
+        p = pool.next < pool.count ? &pool.ports[pool.next++] : NULL;
+        pthread_mutex_unlock(&pool.lock);
+        if (!p)
+            break;
+
+        rc = configure_port(p);
+
+        pthread_mutex_lock(&pool.lock);
+        p->rc = rc;
+        p->done = 1;
+        pthread_cond_broadcast(&pool.cond);
+        pthread_mutex_unlock(&pool.lock);
+    }
+
+    return NULL;
+}
+
+/* Spawn up to jobs threads processing ports, returns number of threads */
+static size_t
+start_workers(pthread_t *threads, size_t jobs, struct port *ports, size_t count)
 {
     size_t i;
+    int rc;
+
+    pool.ports = ports;
+    pool.count = count;
+    pool.next = 0;
+
+    for (i = 0; i < jobs && i < count; i++) {
+        rc = pthread_create(&threads[i], NULL, worker, NULL);
+        if (rc) {
+            errno = rc;
+            perror("pthread_create");
+            break;
+        }
+    }
+
+    return i;
+}
+
+static void
+wait_port(struct port *p)
+{
+    pthread_mutex_lock(&pool.lock);
+    while (!p->done)
+        pthread_cond_wait(&pool.cond, &pool.lock);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+static void
+print_rate(unsigned int n)
+{
+    if (n != BAUDRATE_UNKNOWN)
+        printf("%u", n);
+    else
+        printf("unknown");
+}
 
-    for (i = 0; i < sizeof(map)/sizeof(map[0]); i++) {
-        if (map[i].n == n)
-            return map[i].bn;
+static void
+print_json_string(const char *str)
+{
+    putchar('"');
+    for (; *str; str++) {
+        if (*str == '"' || *str == '\\')
+            printf("\\%c", *str);
+        else if ((unsigned char)*str < 0x20)
+            printf("\\u%04x", (unsigned char)*str);
+        else
+            putchar(*str);
     }
+    putchar('"');
+}
 
-    return B0;
+static const char *
+spd_name(int spd_flags)
+{
+    switch (spd_flags) {
+    case 0:
+        return "none";
+    case ASYNC_SPD_HI:
+        return "hi";
+    case ASYNC_SPD_VHI:
+        return "vhi";
+    case ASYNC_SPD_SHI:
+        return "shi";
+    case ASYNC_SPD_WARP:
+        return "warp";
+    case ASYNC_SPD_CUST:
+        return "cust";
+    default:
+        return "unknown";
+    }
+}
+
+/* Print ioctl timing of port in selected output format, text format items
+   are separated by sep */
+static void
+print_trace(const struct port *p, const char *sep)
+{
+    const char *name;
+    double us;
+    int op, first = 1;
+    size_t i;
+
+    for (op = 0; op < BAUDRATE_TRACE_OPS; op++) {
+        if (!p->trace.count[op])
+            continue;
+        name = baudrate_trace_name(op);
+        us = p->trace.total[op] * 1e6;
+        if (format == FORMAT_JSON) {
+            printf("%s\"%s\":{\"count\":%u,\"total_us\":%.3f}",
+                   first ? "" : ",", name, p->trace.count[op], us);
+        } else if (format == FORMAT_KV) {
+            /* Keys of kv format are lower case */
+            putchar(' ');
+            for (i = 0; name[i]; i++)
+                putchar(name[i] >= 'A' && name[i] <= 'Z' ?
+                        name[i] - 'A' + 'a' : name[i]);
+            printf("_count=%u ", p->trace.count[op]);
+            for (i = 0; name[i]; i++)
+                putchar(name[i] >= 'A' && name[i] <= 'Z' ?
+                        name[i] - 'A' + 'a' : name[i]);
+            printf("_us=%.3f", us);
+        } else {
+            printf("%s%s %u %s %.3f us", first ? "" : sep, name,
+                   p->trace.count[op],
+                   p->trace.count[op] == 1 ? "call" : "calls", us);
+        }
+        first = 0;
+    }
 }
 
-#ifndef BOTHER
-static unsigned int
-map_bn_to_n(tcflag_t bn)
+/* Print aggregated ioctl timing of all drivers */
+static void
+print_trace_drivers(void)
 {
+    struct trace_summary sum;
     size_t i;
 
-    for (i = 0; i < sizeof(map)/sizeof(map[0]); i++) {
-        if (map[i].bn == bn)
-            return map[i].n;
+    for (i = 0; trace_summary(i, &sum) == 0; i++) {
+        if (format == FORMAT_JSON) {
+            printf("{\"driver\":");
+            print_json_string(sum.driver);
+            printf(",\"ioctl\":\"%s\",\"count\":%lu,"
+                   "\"p50_us\":%.3f,\"p99_us\":%.3f}\n",
+                   baudrate_trace_name(sum.op), sum.count, sum.p50, sum.p99);
+        } else if (format == FORMAT_KV) {
+            printf("driver=%s ioctl=%s count=%lu p50_us=%.3f p99_us=%.3f\n",
+                   sum.driver, baudrate_trace_name(sum.op), sum.count,
+                   sum.p50, sum.p99);
+        } else {
+            printf("driver %s %s: %lu calls, p50 %.3f us, p99 %.3f us\n",
+                   sum.driver, baudrate_trace_name(sum.op), sum.count,
+                   sum.p50, sum.p99);
+        }
     }
+    fflush(stdout);
+}
+
+/* Print read back profile settings, unsupported ones with null format */
+static void
+print_opts(const struct port *p, const char *fmt, const char *null)
+{
+    const struct baudrate_opts *opts = &p->opts;
+    const char *names[] = {
+        "low_latency", "vmin", "vtime", "latency_timer", "rx_trigger",
+        "rs485_delay",
+    };
+    int values[] = {
+        opts->low_latency, opts->vmin, opts->vtime,
+        opts->latency_timer, opts->rx_trigger, opts->rs485_delay,
+    };
+    size_t i;
 
-    return (unsigned int)-1;
+    for (i = 0; i < sizeof(names) / sizeof(*names); i++) {
+        if (values[i] >= 0)
+            printf(fmt, names[i], values[i]);
+        else if (null)
+            printf(null, names[i]);
+    }
 }
-#endif
 
-static unsigned int
-get_spd_B38400_alias(int fd)
+static void
+print_json(const struct port *p)
 {
-    struct serial_struct ser;
-    int rc;
+    const struct baudrate_info *info = &p->info;
 
-    rc = ioctl(fd, TIOCGSERIAL, &ser);
-    if (rc)
-        return 38400; /* ASYNC_SPD_MASK is unsupported */
-
-    if (!(ser.flags & ASYNC_SPD_MASK))
-        return 38400; /* ASYNC_SPD_MASK is not set */
-
-    if ((ser.flags & ASYNC_SPD_MASK) == ASYNC_SPD_CUST && !ser.custom_divisor)
-        return 38400; /* ASYNC_SPD_CUST is not active */
-
-    if ((ser.flags & ASYNC_SPD_MASK) == ASYNC_SPD_HI)
-        return 56000;
-    else if ((ser.flags & ASYNC_SPD_MASK) == ASYNC_SPD_VHI)
-        return 115200;
-    else if ((ser.flags & ASYNC_SPD_MASK) == ASYNC_SPD_SHI)
-        return 230400;
-    else if ((ser.flags & ASYNC_SPD_MASK) == ASYNC_SPD_WARP)
-        return 460800;
-    else if ((ser.flags & ASYNC_SPD_MASK) == ASYNC_SPD_CUST)
-        return (ser.baud_base + ser.custom_divisor/2) / ser.custom_divisor;
+    printf("{\"device\":");
+    print_json_string(p->dev);
+    if (p->rc) {
+        printf(",\"error\":");
+        print_json_string(p->error);
+        printf("}\n");
+        return;
+    }
+    printf(",\"output\":");
+    if (info->output != BAUDRATE_UNKNOWN)
+        printf("%u", info->output);
+    else
+        printf("null");
+    printf(",\"input\":");
+    if (info->input != BAUDRATE_UNKNOWN)
+        printf("%u", info->input);
+    else
+        printf("null");
+    if (best_fit && p->set)
+        printf(",\"output_error_ppm\":%ld,\"input_error_ppm\":%ld",
+               p->output_ppm, p->input_ppm);
+    if (verify >= 0 && p->set)
+        printf(",\"verify_output_ppm\":%ld,\"verify_input_ppm\":%ld,"
+               "\"verified\":%s", p->verify_output_ppm, p->verify_input_ppm,
+               p->verified ? "true" : "false");
+    if (profile && p->set)
+        print_opts(p, ",\"%s\":%d", ",\"%s\":null");
+    if (when != BAUDRATE_NOW && p->set)
+        printf(",\"drain_ms\":%.3f", p->drain * 1e3);
+    if (show_timing && p->have_timing)
+        printf(",\"timing\":{\"char_bits\":%u,\"bit_ns\":%llu,\"char_ns\":%llu,"
+               "\"gap15_ns\":%llu,\"gap35_ns\":%llu,\"vtime\":%u}",
+               p->timing.char_bits, p->timing.bit_ns, p->timing.char_ns,
+               p->timing.gap15_ns, p->timing.gap35_ns, p->timing.vtime);
+    else if (show_timing)
+        printf(",\"timing\":null");
+    if (trace_timing) {
+        printf(",\"ioctl\":{");
+        print_trace(p, NULL);
+        printf("}");
+    }
+    printf(",\"cbaud\":%u,\"cibaud\":%u,\"bother\":%s",
+           info->cbaud, info->cibaud, info->bother ? "true" : "false");
+    if (info->serial)
+        printf(",\"spd\":\"%s\",\"custom_divisor\":%d,\"baud_base\":%d",
+               spd_name(info->spd_flags), info->custom_divisor, info->baud_base);
     else
-        return (unsigned int)-1;
+        printf(",\"spd\":null,\"custom_divisor\":null,\"baud_base\":null");
+    printf("}\n");
 }
 
-int
-main(int argc, char *argv[])
+static void
+print_kv(const struct port *p)
 {
-    /* Declare tio structure, its type depends on supported ioctl */
-#ifdef TCGETS2
-    struct termios2 tio;
-#else
-    struct termios tio;
-#endif
-    struct serial_struct ser;
-    unsigned int n;
-    tcflag_t bn;
-    int fd, rc;
+    const struct baudrate_info *info = &p->info;
+    const char *str;
 
-    if (argc != 2 && argc != 3 && argc != 4) {
-        fprintf(stderr, "Usage: %s device [output [input]]\n", argv[0]);
-        exit(EXIT_FAILURE);
+    printf("device=%s", p->dev);
+    if (p->rc) {
+        /* Error message is the only value which may contain spaces */
+        printf(" error=\"");
+        for (str = p->error; *str; str++) {
+            if (*str == '"' || *str == '\\')
+                putchar('\\');
+            putchar(*str);
+        }
+        printf("\"\n");
+        return;
+    }
+    printf(" output=");
+    print_rate(info->output);
+    printf(" input=");
+    print_rate(info->input);
+    if (best_fit && p->set)
+        printf(" output_error_ppm=%ld input_error_ppm=%ld",
+               p->output_ppm, p->input_ppm);
+    if (verify >= 0 && p->set)
+        printf(" verify_output_ppm=%ld verify_input_ppm=%ld verified=%d",
+               p->verify_output_ppm, p->verify_input_ppm, p->verified);
+    if (profile && p->set)
+        print_opts(p, " %s=%d", NULL);
+    if (when != BAUDRATE_NOW && p->set)
+        printf(" drain_ms=%.3f", p->drain * 1e3);
+    if (show_timing && p->have_timing)
+        printf(" char_bits=%u bit_ns=%llu char_ns=%llu gap15_ns=%llu"
+               " gap35_ns=%llu vtime=%u", p->timing.char_bits,
+               p->timing.bit_ns, p->timing.char_ns, p->timing.gap15_ns,
+               p->timing.gap35_ns, p->timing.vtime);
+    if (trace_timing)
+        print_trace(p, NULL);
+    printf(" cbaud=%u cibaud=%u bother=%d", info->cbaud, info->cibaud,
+           info->bother ? 1 : 0);
+    if (info->serial)
+        printf(" spd=%s custom_divisor=%d baud_base=%d",
+               spd_name(info->spd_flags), info->custom_divisor, info->baud_base);
+    printf("\n");
+}
+
+/* Print result or error of one port in selected output format */
+static void
+print_ppm(const struct port *p, long ppm)
+{
+    if (best_fit && p->set)
+        printf(" (error %+ld ppm)", ppm);
+}
+
+static void
+print_verify(const struct port *p, const char *sep)
+{
+    if (verify < 0 || !p->set)
+        return;
+
+    if (p->verified)
+        printf("%sverified within %ld ppm", sep, verify);
+    else if (p->verify_output_ppm == LONG_MAX || p->verify_input_ppm == LONG_MAX)
+        printf("%sverify failed: baud rate is not zero", sep);
+    else
+        printf("%sverify failed: off by %+ld/%+ld ppm", sep,
+               p->verify_output_ppm, p->verify_input_ppm);
+}
+
+/* Text form of line timing, fields are separated by sep */
+static void
+print_timing(const struct port *p, const char *sep)
+{
+    const struct baudrate_timing *t = &p->timing;
+
+    printf("bit time: %.3f us%scharacter time: %.3f us (%u bits)%s"
+           "1.5 character gap: %.3f us%s3.5 character gap: %.3f us%s"
+           "suggested VTIME: %u", t->bit_ns / 1e3, sep, t->char_ns / 1e3,
+           t->char_bits, sep, t->gap15_ns / 1e3, sep, t->gap35_ns / 1e3, sep,
+           t->vtime);
+}
+
+static void
+print_port(const struct port *p, int batch)
+{
+    if (format == FORMAT_JSON) {
+        print_json(p);
+    } else if (format == FORMAT_KV) {
+        print_kv(p);
+    } else if (p->rc) {
+        fprintf(stderr, "%s: %s\n", p->dev, p->error);
+    } else if (batch) {
+        printf("%s: output baud rate: ", p->dev);
+        print_rate(p->info.output);
+        print_ppm(p, p->output_ppm);
+        printf(", input baud rate: ");
+        print_rate(p->info.input);
+        print_ppm(p, p->input_ppm);
+        print_verify(p, ", ");
+        if (profile && p->set)
+            print_opts(p, ", %s: %d", NULL);
+        if (when != BAUDRATE_NOW && p->set)
+            printf(", drained in %.3f ms", p->drain * 1e3);
+        printf("\n");
+        if (show_timing && p->have_timing) {
+            printf("%s: ", p->dev);
+            print_timing(p, ", ");
+            printf("\n");
+        }
+        if (trace_timing) {
+            printf("%s: ioctl timing: ", p->dev);
+            print_trace(p, ", ");
+            printf("\n");
+        }
+    } else {
+        printf("output baud rate: ");
+        print_rate(p->info.output);
+        print_ppm(p, p->output_ppm);
+        printf("\ninput baud rate: ");
+        print_rate(p->info.input);
+        print_ppm(p, p->input_ppm);
+        printf("\n");
+        print_verify(p, "");
+        if (verify >= 0 && p->set)
+            printf("\n");
+        if (profile && p->set)
+            print_opts(p, "%s: %d\n", NULL);
+        if (when != BAUDRATE_NOW && p->set)
+            printf("drain time: %.3f ms\n", p->drain * 1e3);
+        if (show_timing && p->have_timing) {
+            print_timing(p, "\n");
+            printf("\n");
+        }
+        if (trace_timing) {
+            printf("ioctl timing: ");
+            print_trace(p, ", ");
+            printf("\n");
+        }
+    }
+
+    /* Machine formats are streamed, one flushed line per device */
+    if (format != FORMAT_TEXT)
+        fflush(stdout);
+}
+
+/* One port of --group switch, committed from its own thread */
+struct group_member {
+    struct port *port;
+    int fd;
+    struct baudrate_prepared *prep;
+    pthread_barrier_t *barrier;
+    int when;
+    double start; /* tio_now() around commit */
+    double end;
+    int committed; /* needs rollback when other member fails */
+};
+
+static void *
+group_thread(void *arg)
+{
+    struct group_member *m = arg;
+    struct port *p = m->port;
+
+    pthread_barrier_wait(m->barrier);
+    m->start = tio_now();
+    if (baudrate_commit(m->prep, m->when, &p->info.output, &p->info.input))
+        p->rc = port_error(p, "set baud rate");
+    else
+        m->committed = 1;
+    m->end = tio_now();
+    p->drain = baudrate_commit_seconds(m->prep);
+
+    return NULL;
+}
+
+/* Spread of commit start and end times in microseconds */
+struct group_skew {
+    double start;
+    double end;
+};
+
+/* Commit error of any port undoes already committed ones */
+static void
+group_rollback(struct group_member *members, size_t count)
+{
+    size_t i;
+
+    for (i = 0; i < count; i++)
+        if (members[i].port->rc)
+            break;
+    if (i == count)
+        return;
+
+    for (i = 0; i < count; i++) {
+        struct port *p = members[i].port;
+
+        if (p->rc)
+            continue;
+        if (!members[i].committed)
+            snprintf(p->error, sizeof(p->error),
+                     "group: not switched, other device failed");
+        else if (baudrate_rollback(members[i].prep))
+            p->rc = port_error(p, "group: roll back");
+        else
+            snprintf(p->error, sizeof(p->error),
+                     "group: rolled back, other device failed");
+        p->rc = -1;
     }
+}
 
-    fd = open(argv[1], O_RDWR | O_NONBLOCK | O_NOCTTY);
-    if (fd < 0) {
-        perror("open");
+/* Prepare changes of all ports first and then commit them, back to back
+   from pre-spawned threads released by one barrier when threaded is set
+   or one by one otherwise. Nothing is changed when preparing of any port
+   fails and committed ports are rolled back when commit of any fails */
+static int
+group_ports(struct port *ports, size_t count, int when, int threaded,
+            struct group_skew *skew)
+{
+    struct group_member *members;
+    pthread_barrier_t barrier;
+    pthread_t *threads;
+    unsigned int output, input;
+    double min_start, max_start, min_end, max_end;
+    size_t i, started = 0;
+    int rc = 0;
+
+    members = calloc(count, sizeof(*members));
+    threads = calloc(count, sizeof(*threads));
+    if (!members || !threads) {
+        perror("calloc");
         exit(EXIT_FAILURE);
     }
 
-    /* Get the current serial port settings via supported ioctl */
-#ifdef TCGETS2
-    rc = ioctl(fd, TCGETS2, &tio);
-#else
-    rc = ioctl(fd, TCGETS, &tio);
-#endif
-    if (rc) {
-        perror("TCGETS");
+    for (i = 0; i < count; i++) {
+        struct port *p = &ports[i];
+
+        members[i].port = p;
+        members[i].when = when;
+        members[i].barrier = &barrier;
+        members[i].fd = open_device(p->dev);
+        if (members[i].fd < 0) {
+            p->rc = port_error(p, "open");
+        } else if (trace_timing && trace_attach(members[i].fd, &p->trace)) {
+            p->rc = port_error(p, "trace");
+        } else if (!p->set) {
+            snprintf(p->error, sizeof(p->error), "group: baud rate is required");
+            p->rc = -1;
+        } else if (target_rates(p, members[i].fd, &output, &input)) {
+            p->rc = -1;
+        }
+        if (p->rc)
+            rc = -1;
+    }
+
+    /* --best-fit restores ports after trying rates, so snapshots are
+       taken only when all rates are known and prepare writes nothing */
+    for (i = 0; i < count && !rc; i++) {
+        struct port *p = &ports[i];
+
+        if (baudrate_prepare(members[i].fd, p->target_output, p->target_input,
+                             profile, &members[i].prep)) {
+            p->rc = port_error(p, "prepare");
+            rc = -1;
+        }
+    }
+
+    if (!rc && !threaded) {
+        for (i = 0; i < count; i++) {
+            struct port *p = &ports[i];
+
+            if (baudrate_commit(members[i].prep, when, &p->info.output,
+                                &p->info.input)) {
+                p->rc = port_error(p, "set baud rate");
+                break;
+            }
+            members[i].committed = 1;
+        }
+        group_rollback(members, count);
+    } else if (!rc) {
+        if (pthread_barrier_init(&barrier, NULL, count)) {
+            perror("pthread_barrier_init");
+            exit(EXIT_FAILURE);
+        }
+        for (started = 0; started < count; started++) {
+            if (pthread_create(&threads[started], NULL, group_thread,
+                               &members[started]))
+                break;
+        }
+        /* Barrier would never be released with missing thread */
+        if (started < count) {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+        for (i = 0; i < count; i++)
+            pthread_join(threads[i], NULL);
+        pthread_barrier_destroy(&barrier);
+        group_rollback(members, count);
+
+        min_start = max_start = members[0].start;
+        min_end = max_end = members[0].end;
+        for (i = 0; i < count; i++) {
+            if (members[i].start < min_start)
+                min_start = members[i].start;
+            if (members[i].start > max_start)
+                max_start = members[i].start;
+            if (members[i].end < min_end)
+                min_end = members[i].end;
+            if (members[i].end > max_end)
+                max_end = members[i].end;
+        }
+        skew->start = (max_start - min_start) * 1e6;
+        skew->end = (max_end - min_end) * 1e6;
+    }
+
+    for (i = 0; i < count; i++) {
+        struct port *p = &ports[i];
+
+        baudrate_prepared_free(members[i].prep);
+        if (rc && !p->rc) {
+            snprintf(p->error, sizeof(p->error),
+                     "group: not switched, other device failed");
+            p->rc = -1;
+        }
+        if (members[i].fd < 0)
+            continue;
+        if (!rc && !p->rc) {
+            if (profile && baudrate_get_opts(members[i].fd, &p->opts))
+                p->rc = port_error(p, "get profile");
+            /* read_timing() stores its error message */
+            if (!p->rc && show_timing && read_timing(p, members[i].fd))
+                p->rc = -1;
+            if (!p->rc && format != FORMAT_TEXT &&
+                read_info(members[i].fd, &p->info))
+                p->rc = port_error(p, "get baud rate");
+        }
+        if (trace_timing)
+            trace_detach(members[i].fd);
+        if (keep_open && !p->rc)
+            p->fd = members[i].fd;
+        else
+            close(members[i].fd);
+        if (p->rc)
+            rc = -1;
+    }
+
+    free(threads);
+    free(members);
+    return rc;
+}
+
+static void
+print_group(const struct group_skew *skew, size_t count)
+{
+    if (format == FORMAT_JSON)
+        printf("{\"group\":{\"ports\":%zu,\"start_skew_us\":%.1f,"
+               "\"end_skew_us\":%.1f}}\n", count, skew->start, skew->end);
+    else if (format == FORMAT_KV)
+        printf("group ports=%zu start_skew_us=%.1f end_skew_us=%.1f\n",
+               count, skew->start, skew->end);
+    else
+        printf("group switch of %zu ports: start skew %.1f us, "
+               "completion skew %.1f us\n", count, skew->start, skew->end);
+    fflush(stdout);
+}
+
+/* Re-read baud rates of watched port and report when they changed */
+static void
+watch_port(struct port *p)
+{
+    struct baudrate_info info;
+
+    if (p->fd < 0) {
+        /* Device may have appeared again after hotplug */
+        p->fd = open_device(p->dev);
+        if (p->fd < 0)
+            return;
+    }
+
+    memset(&info, 0, sizeof(info));
+    if (read_info(p->fd, &info)) {
+        if (!p->rc) {
+            p->rc = port_error(p, "get baud rate");
+            print_port(p, 1);
+        }
+        close(p->fd);
+        p->fd = -1;
+        return;
+    }
+
+    if (p->rc || memcmp(&info, &p->info, sizeof(info)) != 0) {
+        p->rc = 0;
+        p->info = info;
+        print_port(p, 1);
+        fflush(stdout);
+    }
+}
+
+/* Check if received kernel uevent belongs to tty subsystem */
+static int
+is_tty_uevent(int fd)
+{
+    char buf[4096];
+    ssize_t len;
+    size_t i;
+
+    len = recv(fd, buf, sizeof(buf) - 1, 0);
+    if (len <= 0)
+        return 0;
+    buf[len] = '\0';
+
+    /* Message is ACTION@DEVPATH followed by NUL separated KEY=VALUE */
+    for (i = 0; i < (size_t)len; i += strlen(buf + i) + 1) {
+        if (strcmp(buf + i, "SUBSYSTEM=tty") == 0)
+            return 1;
+    }
+
+    return 0;
+}
+
+/* Open netlink socket for kernel uevents, used as hotplug trigger */
+static int
+open_uevent(void)
+{
+    struct sockaddr_nl addr;
+    int fd;
+
+    fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+    if (fd < 0)
+        return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = 1; /* kernel events */
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr))) {
         close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/* Kernel does not notify about termios changes, so watched ports are
+   re-read periodically from a single epoll loop and immediately after
+   any tty hotplug uevent; this never returns except on error */
+static int
+watch_ports(struct port *ports, size_t count, unsigned int interval)
+{
+    struct epoll_event ev, events[2];
+    struct itimerspec its;
+    uint64_t expirations;
+    int epfd, tfd, nlfd;
+    int n, j, rescan;
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        if (ports[i].fd < 0)
+            ports[i].fd = open_device(ports[i].dev);
+    }
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) {
+        perror("epoll_create1");
+        return -1;
+    }
+
+    tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (tfd < 0) {
+        perror("timerfd_create");
+        return -1;
+    }
+    its.it_interval.tv_sec = interval / 1000;
+    its.it_interval.tv_nsec = (interval % 1000) * 1000000L;
+    its.it_value = its.it_interval;
+    if (timerfd_settime(tfd, 0, &its, NULL)) {
+        perror("timerfd_settime");
+        return -1;
+    }
+    ev.events = EPOLLIN;
+    ev.data.fd = tfd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, tfd, &ev)) {
+        perror("epoll_ctl");
+        return -1;
+    }
+
+    /* Hotplug notifications are optional, timer is enough without them */
+    nlfd = open_uevent();
+    if (nlfd >= 0) {
+        ev.events = EPOLLIN;
+        ev.data.fd = nlfd;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, nlfd, &ev)) {
+            close(nlfd);
+            nlfd = -1;
+        }
+    }
+
+    for (;;) {
+        n = epoll_wait(epfd, events, sizeof(events)/sizeof(events[0]), -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            return -1;
+        }
+
+        rescan = 0;
+        for (j = 0; j < n; j++) {
+            if (events[j].data.fd == tfd) {
+                if (read(tfd, &expirations, sizeof(expirations)) > 0)
+                    rescan = 1;
+            } else if (is_tty_uevent(nlfd)) {
+                rescan = 1;
+            }
+        }
+
+        if (rescan) {
+            for (i = 0; i < count; i++)
+                watch_port(&ports[i]);
+        }
+    }
+}
+
+/* Run throughput benchmark on configured port and print its result */
+static int
+bench_port(struct port *p, const char *peer, unsigned int ms)
+{
+    struct bench_result res;
+    int rx, rc;
+
+    rx = p->fd;
+    if (peer) {
+        rx = open(peer, O_RDWR | O_NONBLOCK | O_NOCTTY);
+        if (rx < 0) {
+            fprintf(stderr, "%s: %s\n", peer, strerror(errno));
+            return -1;
+        }
+    }
+
+    rc = bench_run(p->fd, rx, ms, &res);
+    if (rc)
+        port_error(p, "bench");
+    if (rx != p->fd)
+        close(rx);
+    if (rc) {
+        p->rc = rc;
+        print_port(p, 1);
+        return -1;
+    }
+
+    if (format == FORMAT_JSON) {
+        printf("{\"device\":");
+        print_json_string(p->dev);
+        printf(",\"sent\":%llu,\"received\":%llu,\"errors\":%lu,"
+               "\"seconds\":%.6f,\"rate\":%.0f,\"line_rate\":%.0f}\n",
+               res.sent, res.received, res.errors,
+               res.seconds, res.rate, res.line_rate);
+    } else if (format == FORMAT_KV) {
+        printf("device=%s sent=%llu received=%llu errors=%lu seconds=%.6f "
+               "rate=%.0f line_rate=%.0f\n", p->dev, res.sent, res.received,
+               res.errors, res.seconds, res.rate, res.line_rate);
+    } else {
+        printf("%s: sent %llu bytes, received %llu bytes, %lu errors in %.3f s, "
+               "%.0f bytes/s", p->dev, res.sent, res.received, res.errors,
+               res.seconds, res.rate);
+        if (res.line_rate > 0)
+            printf(" (%.1f%% of line rate %.0f bytes/s)",
+                   100.0 * res.rate / res.line_rate, res.line_rate);
+        printf("\n");
+    }
+    fflush(stdout);
+
+    return res.errors || res.received != res.sent ? -1 : 0;
+}
+
+/* Measure round-trip latency over loopback plug or paired port and print it,
+   low_latency is -1 to keep ASYNC_LOW_LATENCY flag unchanged */
+static int
+latency_port(struct port *p, const char *peer, unsigned int count,
+             unsigned int size, int low_latency)
+{
+    struct latency_result res;
+    const char *state;
+    int rx, rc, enabled;
+
+    if (low_latency >= 0 && baudrate_set_low_latency(p->fd, low_latency)) {
+        p->rc = port_error(p, "low latency");
+        print_port(p, 1);
+        return -1;
+    }
+
+    rx = p->fd;
+    if (peer) {
+        rx = open(peer, O_RDWR | O_NONBLOCK | O_NOCTTY);
+        if (rx < 0) {
+            fprintf(stderr, "%s: %s\n", peer, strerror(errno));
+            return -1;
+        }
+    }
+
+    rc = latency_run(p->fd, rx, count, size, &res);
+    if (rc)
+        port_error(p, "latency");
+    if (rx != p->fd)
+        close(rx);
+    if (rc) {
+        p->rc = rc;
+        print_port(p, 1);
+        return -1;
+    }
+
+    if (baudrate_get_low_latency(p->fd, &enabled))
+        state = "unsupported";
+    else
+        state = enabled ? "on" : "off";
+
+    if (format == FORMAT_JSON) {
+        printf("{\"device\":");
+        print_json_string(p->dev);
+        printf(",\"frames\":%u,\"lost\":%u,\"errors\":%u,\"frame_size\":%u,"
+               "\"min_us\":%.1f,\"median_us\":%.1f,\"p99_us\":%.1f,\"max_us\":%.1f,",
+               res.count, res.lost, res.errors, size,
+               res.min, res.median, res.p99, res.max);
+        if (strcmp(state, "unsupported") == 0)
+            printf("\"low_latency\":null}\n");
+        else
+            printf("\"low_latency\":%s}\n", enabled ? "true" : "false");
+    } else if (format == FORMAT_KV) {
+        printf("device=%s frames=%u lost=%u errors=%u frame_size=%u min_us=%.1f "
+               "median_us=%.1f p99_us=%.1f max_us=%.1f low_latency=%s\n",
+               p->dev, res.count, res.lost, res.errors, size,
+               res.min, res.median, res.p99, res.max, state);
+    } else {
+        printf("%s: %u-byte round trip min %.1f us, median %.1f us, p99 %.1f us, "
+               "max %.1f us (%u frames, %u lost, %u errors, low latency %s)\n",
+               p->dev, size, res.min, res.median, res.p99, res.max,
+               res.count, res.lost, res.errors, state);
+    }
+    fflush(stdout);
+
+    return res.lost || res.errors ? -1 : 0;
+}
+
+static void
+print_autodetect(const struct port *p, const struct autodetect_result *res)
+{
+    if (format == FORMAT_JSON) {
+        printf("{\"device\":");
+        print_json_string(p->dev);
+        printf(",\"detected\":");
+        if (res->rate)
+            printf("%u", res->rate);
+        else
+            printf("null");
+        printf(",\"score\":%.3f,\"bytes\":%lu,\"tried\":%u,\"seconds\":%.6f}\n",
+               res->score, res->bytes, res->tried, res->seconds);
+    } else if (format == FORMAT_KV) {
+        printf("device=%s detected=%u score=%.3f bytes=%lu tried=%u seconds=%.6f\n",
+               p->dev, res->rate, res->score, res->bytes, res->tried, res->seconds);
+    } else if (res->rate) {
+        printf("%s: detected baud rate: %u (score %.3f, %lu bytes, %u rates "
+               "tried in %.0f ms)\n", p->dev, res->rate, res->score, res->bytes,
+               res->tried, res->seconds * 1000);
+    } else {
+        printf("%s: baud rate not detected (%u rates tried in %.0f ms)\n",
+               p->dev, res->tried, res->seconds * 1000);
+    }
+    fflush(stdout);
+}
+
+/* Ports selected for autodetect_ports() */
+struct detect {
+    struct port **ports;
+    int failed;
+};
+
+static void
+detect_done(void *ctx, size_t index, int rc, const struct autodetect_result *res)
+{
+    struct detect *detect = ctx;
+    struct port *p = detect->ports[index];
+
+    if (rc) {
+        p->rc = port_error(p, "autodetect");
+        print_port(p, 1);
+        detect->failed = 1;
+        return;
+    }
+
+    print_autodetect(p, res);
+    if (!res->rate)
+        detect->failed = 1;
+}
+
+/* Detect baud rate of incoming traffic on all configured ports at once,
+   with at most jobs ports sampled concurrently, and leave each port
+   configured to detected rate; results are printed as ports finish */
+static int
+autodetect_ports(struct port *ports, size_t count, size_t jobs,
+                 const unsigned int *rates, size_t nrates)
+{
+    struct detect detect = { NULL, 0 };
+    size_t i, n = 0;
+    int *fds;
+
+    detect.ports = calloc(count, sizeof(*detect.ports));
+    fds = calloc(count, sizeof(*fds));
+    if (!detect.ports || !fds) {
+        perror("calloc");
+        free(detect.ports);
+        free(fds);
+        return -1;
+    }
+
+    for (i = 0; i < count; i++) {
+        if (ports[i].rc)
+            continue;
+        detect.ports[n] = &ports[i];
+        fds[n++] = ports[i].fd;
+    }
+
+    if (n && autodetect_run_many(fds, n, rates, nrates, jobs,
+                                 detect_done, &detect)) {
+        perror("autodetect");
+        detect.failed = 1;
+    }
+
+    free(detect.ports);
+    free(fds);
+    return detect.failed ? -1 : 0;
+}
+
+static int
+parse_rate(const char *str, char **end, unsigned int *n)
+{
+    unsigned long val;
+
+    errno = 0;
+    val = strtoul(str, end, 10);
+    if (errno || *end == str || val > (unsigned int)-1)
+        return -1;
+
+    *n = val;
+    return 0;
+}
+
+/* Parse comma separated list of baud rates */
+static int
+parse_rates(const char *str, unsigned int *rates, size_t max, size_t *count)
+{
+    char *end;
+
+    *count = 0;
+    for (;;) {
+        if (*count == max || parse_rate(str, &end, &rates[*count]))
+            return -1;
+        (*count)++;
+        if (*end == '\0')
+            return 0;
+        if (*end != ',')
+            return -1;
+        str = end + 1;
+    }
+}
+
+/* Parse device[=output[:input]] batch specification */
+static int
+parse_spec(char *spec, struct port *p)
+{
+    char *eq, *end;
+
+    memset(p, 0, sizeof(*p));
+    p->dev = spec;
+    p->fd = -1;
+
+    eq = strrchr(spec, '=');
+    if (!eq)
+        return 0;
+    if (eq == spec)
+        return -1;
+    *eq = '\0';
+
+    p->set = 1;
+    if (parse_rate(eq + 1, &end, &p->output))
+        goto invalid;
+    p->input = p->output;
+    if (*end == ':' && parse_rate(end + 1, &end, &p->input))
+        goto invalid;
+    if (*end)
+        goto invalid;
+
+    return 0;
+
+invalid:
+    /* Restore original specification for error message */
+    *eq = '=';
+    return -1;
+}
+
+static int
+add_spec(struct port **ports, size_t *count, size_t *alloc, char *spec)
+{
+    struct port *tmp;
+
+    if (*count == *alloc) {
+        *alloc = *alloc ? *alloc * 2 : 16;
+        tmp = realloc(*ports, *alloc * sizeof(**ports));
+        if (!tmp) {
+            perror("realloc");
+            return -1;
+        }
+        *ports = tmp;
+    }
+
+    if (parse_spec(spec, &(*ports)[*count])) {
+        fprintf(stderr, "invalid device specification: %s\n", spec);
+        return -1;
+    }
+
+    (*count)++;
+    return 0;
+}
+
+/* Read batch specifications from file, one per line, # starts comment */
+static int
+read_specs(const char *path, struct port **ports, size_t *count, size_t *alloc)
+{
+    char *line = NULL, *spec, *ptr;
+    size_t size = 0;
+    FILE *file;
+    int ret = 0;
+
+    if (strcmp(path, "-") == 0) {
+        file = stdin;
+    } else {
+        file = fopen(path, "r");
+        if (!file) {
+            perror(path);
+            return -1;
+        }
+    }
+
+    while (getline(&line, &size, file) >= 0) {
+        ptr = strchr(line, '#');
+        if (ptr)
+            *ptr = '\0';
+        spec = strtok(line, " \t\r\n");
+        if (!spec)
+            continue;
+        spec = strdup(spec);
+        if (!spec) {
+            perror("strdup");
+            ret = -1;
+            break;
+        }
+        if (add_spec(ports, count, alloc, spec)) {
+            ret = -1;
+            break;
+        }
+    }
+
+    if (!ret && ferror(file)) {
+        perror(path);
+        ret = -1;
+    }
+
+    free(line);
+    if (file != stdin)
+        fclose(file);
+    return ret;
+}
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s device [output [input]]\n"
+            "       %s [options] device[=output[:input]]...\n"
+            "       %s --udev (device from DEVNAME, output[:input] from BAUDRATE)\n"
+            "Options:\n"
+            "  -f file                 read device specifications from file, - for stdin\n"
+            "  -j jobs                 configure or autodetect up to jobs devices in parallel,\n"
+            "                          autodetect samples all devices at once by default\n"
+            "  --watch[=ms]            report baud rate changes, re-read every ms\n"
+            "  --format=text|json|kv   output format\n"
+            "  --best-fit              set closest achievable baud rate and report error\n"
+            "  --verify[=ppm]          compare read back baud rates with requested ones,\n"
+            "                          exit with status 2 when over tolerance, default 0\n"
+            "  --profile=lowlatency|throughput\n"
+            "                          tune latency flag, VMIN/VTIME and FIFO with baud rate\n"
+            "  --rs485-delay=chars     set RS-485 RTS delays before and after send to\n"
+            "                          chars character times of the new baud rate\n"
+            "  --bench[=ms]            measure throughput over loopback plug for ms\n"
+            "  --latency[=count]       measure round-trip time of count frames\n"
+            "  --frame-size=bytes      size of --latency frame, default 1\n"
+            "  --low-latency=on|off    set ASYNC_LOW_LATENCY flag before --latency\n"
+            "  --peer=device           receive --bench or --latency data on paired device\n"
+            "  --autodetect            detect baud rate of incoming traffic\n"
+            "  --rates=n[,n]...        custom baud rates tried first by --autodetect\n"
+            "  --state=file            remember set baud rates, apply them to devices\n"
+            "                          given without baud rate\n"
+            "  --group[=drain]         switch all devices at the same moment and report\n"
+            "                          skew, optionally after their output is drained\n"
+            "  --all-or-nothing        set all devices or none, roll back already set\n"
+            "                          ones when any of them fails\n"
+            "  --drain                 set baud rate after pending output is sent and\n"
+            "                          report how long it took\n"
+            "  --flush                 like --drain and discard pending input\n"
+            "  --timing                report bit and character time, 1.5 and 3.5\n"
+            "                          character gaps and VTIME of configured rate\n"
+            "  --simulate=spec         use simulated driver instead of devices, spec is\n"
+            "                          base=n,round=exact|divisor|standard,latency=us\n"
+            "  --trace-timing          report duration of every ioctl, per device and\n"
+            "                          aggregated per driver in batch mode\n"
+            "  --probe                 find supported baud rates of devices, with --state\n"
+            "                          remember them per driver and skip refused rates\n"
+            "  --list-rates[=min-max]  list exact baud rates which devices can produce\n"
+            "  --hold                  keep configured devices open until terminated\n"
+            "  --exec=cmd              run cmd with configured devices as fds 3, 4, ...\n",
+            prog, prog, prog);
+    exit(EXIT_FAILURE);
+}
+
+/* Apply settings stored in state file to port without requested baud rate */
+static void
+state_apply(struct state *st, struct port *p)
+{
+    struct state_entry entry;
+    char key[STATE_KEY_SIZE];
+
+    if (p->set)
+        return;
+
+    state_key(p->dev, key, sizeof(key));
+    if (state_lookup(st, key, &entry))
+        return;
+
+    /* Already configured port is skipped by fast path of baudrate_change() */
+    p->set = 1;
+    p->output = entry.output;
+    p->input = entry.input;
+}
+
+/* Load capabilities of port stored by --probe */
+static void
+state_apply_caps(struct state *st, struct port *p)
+{
+    struct state_caps caps;
+    char key[STATE_KEY_SIZE];
+
+    if (state_caps_key(p->dev, key, sizeof(key)) ||
+        state_caps_lookup(st, key, &caps))
+        return;
+
+    p->caps.standard = caps.standard;
+    p->caps.bother = caps.bother;
+    p->caps.split = caps.split;
+    p->caps.baud_base = caps.baud_base;
+    p->caps.min_divisor_rate = caps.min_divisor_rate;
+    p->caps.standard_exact = caps.standard_exact;
+    p->have_caps = 1;
+}
+
+/* Remember requested and verified baud rates of configured port */
+static int
+state_update(struct state *st, const struct port *p)
+{
+    struct state_entry entry;
+
+    memset(&entry, 0, sizeof(entry));
+    state_key(p->dev, entry.key, sizeof(entry.key));
+    entry.output = p->output;
+    entry.input = p->input;
+    entry.cur_output = p->info.output;
+    entry.cur_input = p->info.input;
+
+    if (state_store(st, &entry)) {
+        fprintf(stderr, "%s: store state: %s\n", p->dev, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Keep configured ports open until terminated, so the last close() cannot
+   drop DTR via HUPCL or let driver reset settings before application opens
+   the port */
+static int
+hold_ports(void)
+{
+    sigset_t set;
+    int sig;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGHUP);
+    if (pthread_sigmask(SIG_BLOCK, &set, NULL) || sigwait(&set, &sig)) {
+        perror("sigwait");
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Replace process by cmd which inherits configured ports as blocking fds
+   3, 4, ... in order of specifications, their count is in BAUDRATE_FDS */
+static int
+exec_ports(struct port *ports, size_t count, const char *cmd)
+{
+    char buf[16];
+    size_t i;
+    int fd, flags;
+
+    /* Move fds out of the way first, targets may be occupied by them */
+    for (i = 0; i < count; i++) {
+        fd = fcntl(ports[i].fd, F_DUPFD_CLOEXEC, (int)(3 + count));
+        if (fd < 0) {
+            perror("fcntl");
+            return -1;
+        }
+        close(ports[i].fd);
+        ports[i].fd = fd;
+    }
+
+    for (i = 0; i < count; i++) {
+        fd = 3 + i;
+        flags = fcntl(ports[i].fd, F_GETFL);
+        if (dup2(ports[i].fd, fd) < 0 || flags < 0 ||
+            fcntl(fd, F_SETFL, flags & ~O_NONBLOCK)) {
+            perror(ports[i].dev);
+            return -1;
+        }
+    }
+
+    snprintf(buf, sizeof(buf), "%zu", count);
+    if (setenv("BAUDRATE_FDS", buf, 1)) {
+        perror("setenv");
+        return -1;
+    }
+
+    fflush(stdout);
+    execl("/bin/sh", "sh", "-c", cmd, (char *)NULL);
+    perror("/bin/sh");
+    return -1;
+}
+
+/* Print rates whose bit is set in mask, separated as format needs */
+static void
+print_rate_mask(const unsigned int *rates, size_t nrates,
+                unsigned long long mask)
+{
+    size_t i;
+    int first = 1;
+
+    for (i = 0; i < nrates && i < 64; i++) {
+        if (!(mask & (1ULL << i)))
+            continue;
+        printf("%s%u", format == FORMAT_TEXT ? " " : first ? "" : ",", rates[i]);
+        first = 0;
+    }
+}
+
+/* Characterise port and print its capabilities, store them into state file
+   when st is not NULL */
+static int
+probe_port(struct port *p, struct state *st)
+{
+    const char *custom[] = { "no", "rounded", "exact" };
+    struct baudrate_caps caps;
+    struct state_caps entry;
+    const unsigned int *rates;
+    unsigned long long rounded;
+    size_t nrates;
+
+    if (baudrate_probe(p->fd, &caps)) {
+        p->rc = port_error(p, "probe");
+        print_port(p, 1);
+        return -1;
+    }
+
+    nrates = baudrate_list_standard(&rates);
+    rounded = caps.standard & ~caps.standard_exact;
+    if (format == FORMAT_JSON) {
+        printf("{\"device\":");
+        print_json_string(p->dev);
+        printf(",\"standard_rates\":[");
+        print_rate_mask(rates, nrates, caps.standard);
+        printf("],\"rounded_rates\":[");
+        print_rate_mask(rates, nrates, rounded);
+        printf("]");
+    } else if (format == FORMAT_KV) {
+        printf("device=%s standard_rates=", p->dev);
+        print_rate_mask(rates, nrates, caps.standard);
+        printf(" rounded_rates=");
+        print_rate_mask(rates, nrates, rounded);
+    } else {
+        printf("%s: standard baud rates:", p->dev);
+        print_rate_mask(rates, nrates, caps.standard);
+        if (rounded) {
+            printf("\n%s: rounded by driver:", p->dev);
+            print_rate_mask(rates, nrates, rounded);
+        }
+    }
+    if (format == FORMAT_JSON) {
+        printf(",\"custom_rates\":\"%s\",\"split\":%s",
+               custom[caps.bother], caps.split ? "true" : "false");
+        if (caps.baud_base)
+            printf(",\"baud_base\":%u,\"min_divisor_rate\":%u}\n",
+                   caps.baud_base, caps.min_divisor_rate);
+        else
+            printf(",\"baud_base\":null,\"min_divisor_rate\":null}\n");
+    } else if (format == FORMAT_KV) {
+        printf(" custom_rates=%s split=%d", custom[caps.bother], caps.split);
+        if (caps.baud_base)
+            printf(" baud_base=%u min_divisor_rate=%u",
+                   caps.baud_base, caps.min_divisor_rate);
+        printf("\n");
+    } else {
+        printf("\n%s: other baud rates: %s, split baud rates: %s",
+               p->dev, custom[caps.bother], caps.split ? "yes" : "no");
+        if (caps.baud_base)
+            printf(", divisor baud rates: %u to %u",
+                   caps.min_divisor_rate, caps.baud_base);
+        printf("\n");
+    }
+    fflush(stdout);
+
+    if (!st)
+        return 0;
+
+    /* Ports without driver, e.g. pty, have nothing to share caps with */
+    memset(&entry, 0, sizeof(entry));
+    if (state_caps_key(p->dev, entry.key, sizeof(entry.key)))
+        return 0;
+    entry.standard = caps.standard;
+    entry.bother = caps.bother;
+    entry.split = caps.split;
+    entry.baud_base = caps.baud_base;
+    entry.min_divisor_rate = caps.min_divisor_rate;
+    entry.standard_exact = caps.standard_exact;
+    if (state_caps_store(st, &entry)) {
+        fprintf(stderr, "%s: store caps: %s\n", p->dev, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Upper limit of rates printed by --list-rates */
+#define LIST_MAX_RATES 65536
+
+/* Print all exact baud rates of port between min and max */
+static int
+list_rates_port(struct port *p, unsigned int min, unsigned int max)
+{
+    unsigned int *rates;
+    size_t i, count;
+    double start, ms;
+    int rc;
+
+    rates = malloc(LIST_MAX_RATES * sizeof(*rates));
+    if (!rates) {
+        perror("malloc");
         exit(EXIT_FAILURE);
     }
 
-    /* Change baud rate when more arguments were provided */
-    if (argc == 3 || argc == 4) {
-        /* Clear the current output baud rate and fill a new value */
-        n = atoi(argv[2]);
-        /* When possible prefer usage of Bnnn constant as glibc-based
-           applications are not able to parse BOTHER c_ospeed baud rate */
-        bn = map_n_to_bn(n);
-        if (n != 0 && bn == B0) {
-#ifdef BOTHER
-            bn = BOTHER;
-#else
-            rc = ioctl(fd, TIOCGSERIAL, &ser);
-            if (rc) {
-                fprintf(stderr, "baud rate %u is unsupported\n", n);
-                close(fd);
+    start = tio_now();
+    rc = baudrate_list_rates(p->fd, min, max, rates, LIST_MAX_RATES, &count);
+    ms = (tio_now() - start) * 1e3;
+    if (rc < 0) {
+        p->rc = port_error(p, "list rates");
+        print_port(p, 1);
+        free(rates);
+        return -1;
+    }
+
+    if (format == FORMAT_JSON) {
+        printf("{\"device\":");
+        print_json_string(p->dev);
+        printf(",\"min\":%u,\"max\":%u,\"rates\":[", min, max);
+        for (i = 0; i < count; i++)
+            printf("%s%u", i ? "," : "", rates[i]);
+        printf("],\"truncated\":%s,\"ms\":%.3f}\n", rc ? "true" : "false", ms);
+    } else if (format == FORMAT_KV) {
+        printf("device=%s min=%u max=%u rates=", p->dev, min, max);
+        for (i = 0; i < count; i++)
+            printf("%s%u", i ? "," : "", rates[i]);
+        printf(" truncated=%d ms=%.3f\n", rc, ms);
+    } else {
+        printf("%s: %zu%s exact baud rates from %u to %u found in %.3f ms:",
+               p->dev, count, rc ? "+" : "", min, max, ms);
+        for (i = 0; i < count; i++)
+            printf(" %u", rates[i]);
+        printf("%s\n", rc ? " ..." : "");
+    }
+    fflush(stdout);
+
+    free(rates);
+    return 0;
+}
+
+/* Values for long only options */
+enum {
+    OPT_WATCH = 256,
+    OPT_FORMAT,
+    OPT_BEST_FIT,
+    OPT_VERIFY,
+    OPT_BENCH,
+    OPT_PEER,
+    OPT_LATENCY,
+    OPT_FRAME_SIZE,
+    OPT_LOW_LATENCY,
+    OPT_AUTODETECT,
+    OPT_RATES,
+    OPT_PROFILE,
+    OPT_RS485_DELAY,
+    OPT_STATE,
+    OPT_HOLD,
+    OPT_EXEC,
+    OPT_GROUP,
+    OPT_ALL_OR_NOTHING,
+    OPT_DRAIN,
+    OPT_FLUSH,
+    OPT_TIMING,
+    OPT_SIMULATE,
+    OPT_TRACE_TIMING,
+    OPT_PROBE,
+    OPT_LIST_RATES,
+};
+
+static const struct option options[] = {
+    { "watch", optional_argument, NULL, OPT_WATCH },
+    { "format", required_argument, NULL, OPT_FORMAT },
+    { "best-fit", no_argument, NULL, OPT_BEST_FIT },
+    { "verify", optional_argument, NULL, OPT_VERIFY },
+    { "bench", optional_argument, NULL, OPT_BENCH },
+    { "peer", required_argument, NULL, OPT_PEER },
+    { "latency", optional_argument, NULL, OPT_LATENCY },
+    { "frame-size", required_argument, NULL, OPT_FRAME_SIZE },
+    { "low-latency", required_argument, NULL, OPT_LOW_LATENCY },
+    { "autodetect", no_argument, NULL, OPT_AUTODETECT },
+    { "rates", required_argument, NULL, OPT_RATES },
+    { "profile", required_argument, NULL, OPT_PROFILE },
+    { "rs485-delay", required_argument, NULL, OPT_RS485_DELAY },
+    { "state", required_argument, NULL, OPT_STATE },
+    { "hold", no_argument, NULL, OPT_HOLD },
+    { "exec", required_argument, NULL, OPT_EXEC },
+    { "group", optional_argument, NULL, OPT_GROUP },
+    { "all-or-nothing", no_argument, NULL, OPT_ALL_OR_NOTHING },
+    { "drain", no_argument, NULL, OPT_DRAIN },
+    { "flush", no_argument, NULL, OPT_FLUSH },
+    { "timing", no_argument, NULL, OPT_TIMING },
+    { "simulate", required_argument, NULL, OPT_SIMULATE },
+    { "trace-timing", no_argument, NULL, OPT_TRACE_TIMING },
+    { "probe", no_argument, NULL, OPT_PROBE },
+    { "list-rates", optional_argument, NULL, OPT_LIST_RATES },
+    { NULL, 0, NULL, 0 },
+};
+
+int
+main(int argc, char *argv[])
+{
+    struct port *ports = NULL;
+    size_t count = 0, alloc = 0, i;
+    size_t jobs = 0, nthreads = 0; /* jobs is 0 without -j */
+    pthread_t *threads = NULL;
+    const char *file = NULL;
+    int batch = 0, ret = EXIT_SUCCESS;
+    unsigned int n, watch = 0, bench = 0, latency = 0, frame_size = 1;
+    int low_latency = -1, autodetect = 0, rs485_delay = -1;
+    unsigned int rates[AUTODETECT_MAX_RATES];
+    size_t nrates = 0;
+    const char *peer = NULL;
+    const char *state_path = NULL;
+    const char *cmd = NULL;
+    int hold = 0, group = -1, grouped = 0, probe = 0, list_rates = 0;
+    int all_or_nothing = 0;
+    unsigned int list_min = 50, list_max = 12000000;
+    struct group_skew skew = { 0, 0 };
+    struct sim_config sim;
+    struct state st;
+    char *end;
+    int opt;
+
+    /* Checked before anything else, it has to stay cheap for every port */
+    if (argc == 2 && strcmp(argv[1], "--udev") == 0)
+        return udev_main();
+
+    while ((opt = getopt_long(argc, argv, "+f:j:", options, NULL)) != -1) {
+        switch (opt) {
+        case 'f':
+            file = optarg;
+            batch = 1;
+            break;
+        case 'j':
+            if (parse_rate(optarg, &end, &n) || *end || n == 0) {
+                fprintf(stderr, "invalid number of jobs: %s\n", optarg);
                 exit(EXIT_FAILURE);
             }
-            /* B38400 is aliased to different baud rate configured by
-               custom_divisor field when ASYNC_SPD_MASK flag is set to
-               ASYNC_SPD_CUST value via TIOCSSERIAL */
-            bn = B38400;
-            ser.flags &= ~ASYNC_SPD_MASK;
-            ser.flags |= ASYNC_SPD_CUST;
-            ser.custom_divisor = (ser.baud_base + n/2) / n;
-            rc = ioctl(fd, TIOCSSERIAL, &ser);
-            if (rc) {
-                perror("TIOCSSERIAL");
-                close(fd);
+            jobs = n;
+            break;
+        case OPT_WATCH:
+            watch = 1000;
+            if (optarg && (parse_rate(optarg, &end, &watch) || *end || watch == 0)) {
+                fprintf(stderr, "invalid watch interval: %s\n", optarg);
                 exit(EXIT_FAILURE);
             }
-#endif
-        } else if (n == 38400) {
-            rc = ioctl(fd, TIOCGSERIAL, &ser);
-            if (!rc && (ser.flags & ASYNC_SPD_MASK)) {
-                /* Clear ASYNC_SPD_MASK flag via TIOCSSERIAL
-                   as it aliases 38400 to some other baud rate */
-                ser.flags &= ~ASYNC_SPD_MASK;
-                ser.custom_divisor = 0;
-                rc = ioctl(fd, TIOCSSERIAL, &ser);
-                if (rc) {
-                    perror("TIOCSSERIAL");
-                    close(fd);
-                    exit(EXIT_FAILURE);
-                }
+            batch = 1;
+            keep_open = 1;
+            break;
+        case OPT_FORMAT:
+            if (strcmp(optarg, "text") == 0) {
+                format = FORMAT_TEXT;
+            } else if (strcmp(optarg, "json") == 0) {
+                format = FORMAT_JSON;
+            } else if (strcmp(optarg, "kv") == 0) {
+                format = FORMAT_KV;
+            } else {
+                fprintf(stderr, "invalid format: %s\n", optarg);
+                exit(EXIT_FAILURE);
             }
-        }
-        tio.c_cflag &= ~CBAUD;
-        tio.c_cflag |= bn;
-#ifdef BOTHER
-        tio.c_ospeed = n;
-#endif
-
-        /* When 4th argument is not provided reuse output baud rate */
-        if (argc == 4) {
-            n = atoi(argv[3]);
-            bn = map_n_to_bn(n);
-            if (n != 0 && bn == B0) {
-#ifdef BOTHER
-                bn = BOTHER;
-#else
-                if (n != (unsigned int)atoi(argv[2])) {
-                    fprintf(stderr, "input baud rate %u is unsupported\n", n);
-                    close(fd);
-                    exit(EXIT_FAILURE);
-                }
-                /* Set B38400 for ASYNC_SPD_CUST */
-                bn = B38400;
-#endif
+            break;
+        case OPT_BEST_FIT:
+            best_fit = 1;
+            break;
+        case OPT_VERIFY:
+            verify = 0;
+            if (optarg && (parse_rate(optarg, &end, &n) || *end)) {
+                fprintf(stderr, "invalid verify tolerance: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            if (optarg)
+                verify = n;
+            break;
+        case OPT_BENCH:
+            bench = 1000;
+            if (optarg && (parse_rate(optarg, &end, &bench) || *end || bench == 0)) {
+                fprintf(stderr, "invalid bench duration: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            keep_open = 1;
+            break;
+        case OPT_PEER:
+            peer = optarg;
+            break;
+        case OPT_LATENCY:
+            latency = 100;
+            if (optarg && (parse_rate(optarg, &end, &latency) || *end || latency == 0)) {
+                fprintf(stderr, "invalid latency frame count: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            keep_open = 1;
+            break;
+        case OPT_FRAME_SIZE:
+            if (parse_rate(optarg, &end, &frame_size) || *end || frame_size == 0) {
+                fprintf(stderr, "invalid frame size: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case OPT_AUTODETECT:
+            autodetect = 1;
+            batch = 1;
+            keep_open = 1;
+            break;
+        case OPT_RATES:
+            if (parse_rates(optarg, rates, AUTODETECT_MAX_RATES, &nrates)) {
+                fprintf(stderr, "invalid list of baud rates: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case OPT_GROUP:
+            group = BAUDRATE_NOW;
+            if (optarg && strcmp(optarg, "drain") == 0) {
+                group = BAUDRATE_DRAIN;
+            } else if (optarg) {
+                fprintf(stderr, "invalid group mode: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            batch = 1;
+            break;
+        case OPT_ALL_OR_NOTHING:
+            all_or_nothing = 1;
+            batch = 1;
+            break;
+        case OPT_DRAIN:
+            when = BAUDRATE_DRAIN;
+            break;
+        case OPT_FLUSH:
+            when = BAUDRATE_FLUSH;
+            break;
+        case OPT_TIMING:
+            show_timing = 1;
+            break;
+        case OPT_SIMULATE:
+            if (sim_parse(optarg, &sim)) {
+                fprintf(stderr, "invalid simulated driver: %s\n", optarg);
+                exit(EXIT_FAILURE);
             }
-            if ((tio.c_cflag & CBAUD) != B0 && n == 0) {
-#ifdef BOTHER
-                bn = BOTHER;
-#else
-                fprintf(stderr, "input baud rate cannot be zero\n");
-                close(fd);
+            sim_enable(&sim);
+            simulate = 1;
+            break;
+        case OPT_TRACE_TIMING:
+            trace_timing = 1;
+            trace_enable();
+            break;
+        case OPT_PROBE:
+            probe = 1;
+            keep_open = 1;
+            break;
+        case OPT_LIST_RATES:
+            list_rates = 1;
+            if (optarg && (parse_rate(optarg, &end, &list_min) || *end != '-' ||
+                           parse_rate(end + 1, &end, &list_max) || *end ||
+                           list_min > list_max)) {
+                fprintf(stderr, "invalid range of baud rates: %s\n", optarg);
                 exit(EXIT_FAILURE);
-#endif
             }
+            keep_open = 1;
+            break;
+        case OPT_HOLD:
+            hold = 1;
+            keep_open = 1;
+            break;
+        case OPT_EXEC:
+            cmd = optarg;
+            keep_open = 1;
+            break;
+        case OPT_STATE:
+            state_path = optarg;
+            batch = 1;
+            break;
+        case OPT_PROFILE:
+            if (strcmp(optarg, "lowlatency") == 0) {
+                profile = &profile_lowlatency;
+            } else if (strcmp(optarg, "throughput") == 0) {
+                profile = &profile_throughput;
+            } else {
+                fprintf(stderr, "invalid profile: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case OPT_RS485_DELAY:
+            if (parse_rate(optarg, &end, &n) || *end || n > INT_MAX) {
+                fprintf(stderr, "invalid RS-485 delay: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            rs485_delay = n;
+            break;
+        case OPT_LOW_LATENCY:
+            if (strcmp(optarg, "on") == 0) {
+                low_latency = 1;
+            } else if (strcmp(optarg, "off") == 0) {
+                low_latency = 0;
+            } else {
+                fprintf(stderr, "invalid low latency value: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        default:
+            usage(argv[0]);
         }
+    }
+
+    for (i = optind; i < (size_t)argc; i++) {
+        if (strchr(argv[i], '='))
+            batch = 1;
+    }
+
+    if (cmd && watch) {
+        fprintf(stderr, "--exec cannot be used with --watch\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (peer && !bench && !latency) {
+        fprintf(stderr, "--peer requires --bench or --latency\n");
+        exit(EXIT_FAILURE);
+    }
 
-        /* Clear the current input baud rate and fill a new value */
-        if ((tio.c_cflag & CBAUD) != bn
-#ifdef BOTHER
-            || (bn == BOTHER && tio.c_ospeed != n)
-#endif
-           ) {
-#ifdef IBSHIFT
-            tio.c_cflag &= ~(CBAUD << IBSHIFT);
-            tio.c_cflag |= bn << IBSHIFT;
-#ifdef BOTHER
-            tio.c_ispeed = n;
-#endif
-#else
-            fprintf(stderr, "split baud rates are unsupported\n");
-            close(fd);
+    if (rs485_delay >= 0) {
+        if (profile)
+            profile_custom = *profile;
+        else
+            baudrate_opts_init(&profile_custom);
+        profile_custom.rs485_delay = rs485_delay;
+        profile = &profile_custom;
+    }
+
+    if (batch) {
+        /* Batch mode: every argument is one device specification */
+        if (file && read_specs(file, &ports, &count, &alloc))
             exit(EXIT_FAILURE);
-#endif
-        } else {
-#ifdef IBSHIFT
-            /* B0 sets the input baud rate to the output baud rate */
-            tio.c_cflag &= ~(CBAUD << IBSHIFT);
-            tio.c_cflag |= B0 << IBSHIFT;
-#ifdef BOTHER
-            tio.c_ispeed = 0;
-#endif
-#endif
-        }
-
-        /* Set new serial port settings via supported ioctl */
-#ifdef TCSETS2
-        rc = ioctl(fd, TCSETS2, &tio);
-#else
-        rc = ioctl(fd, TCSETS, &tio);
-#endif
-        if (rc) {
-            perror("TCSETS");
-            close(fd);
+        for (i = optind; i < (size_t)argc; i++) {
+            if (add_spec(&ports, &count, &alloc, argv[i]))
+                exit(EXIT_FAILURE);
+        }
+        if (!count)
+            usage(argv[0]);
+    } else {
+        /* Legacy mode: device [output [input]] */
+        if (argc - optind < 1 || argc - optind > 3)
+            usage(argv[0]);
+        ports = calloc(1, sizeof(*ports));
+        if (!ports) {
+            perror("calloc");
             exit(EXIT_FAILURE);
         }
+        count = 1;
+        ports[0].dev = argv[optind];
+        ports[0].fd = -1;
+        if (argc - optind >= 2) {
+            ports[0].set = 1;
+            ports[0].output = atoi(argv[optind+1]);
+            /* When input argument is not provided reuse output baud rate */
+            ports[0].input = ports[0].output;
+        }
+        if (argc - optind == 3)
+            ports[0].input = atoi(argv[optind+2]);
+    }
 
-        /* And get new values which were really configured */
-#ifdef TCGETS2
-        rc = ioctl(fd, TCGETS2, &tio);
-#else
-        rc = ioctl(fd, TCGETS, &tio);
-#endif
-        if (rc) {
-            perror("TCGETS");
-            close(fd);
+    if (state_path) {
+        if (state_open(&st, state_path)) {
+            fprintf(stderr, "%s: %s\n", state_path, strerror(errno));
             exit(EXIT_FAILURE);
         }
+        for (i = 0; i < count; i++) {
+            state_apply(&st, &ports[i]);
+            state_apply_caps(&st, &ports[i]);
+        }
     }
 
-    /* Field c_ospeed is always filled by kernel with exact baud rate value,
-       kernel tries to round c_ospeed to some Bnnn constant in 2% tolerance,
-       if it is not possible then BOTHER is set */
-    bn = tio.c_cflag & CBAUD;
-#ifdef BOTHER
-    n = tio.c_ospeed;
-#else
-    n = map_bn_to_n(bn);
-#endif
-    /* B38400 can be aliased by ASYNC_SPD_MASK flag */
-    if (bn == B38400)
-        n = get_spd_B38400_alias(fd);
-    printf("output baud rate: ");
-    if (n != (unsigned int)-1)
-        printf("%u\n", n);
-    else
-        printf("unknown\n");
-
-#ifdef IBSHIFT
-    bn = (tio.c_cflag >> IBSHIFT) & CBAUD;
-    /* B0 indicates that input baud rate is set to the output baud rate */
-    if (bn == B0)
-#endif
-        bn = tio.c_cflag & CBAUD;
-#ifdef BOTHER
-    n = tio.c_ispeed;
-#else
-    n = map_bn_to_n(bn);
-#endif
-    /* B38400 can be aliased by ASYNC_SPD_MASK flag */
-    if (bn == B38400)
-        n = get_spd_B38400_alias(fd);
-    printf("input baud rate: ");
-    if (n != (unsigned int)-1)
-        printf("%u\n", n);
-    else
-        printf("unknown\n");
+    /* Group is already configured when results are printed */
+    if (group >= 0) {
+        grouped = 1;
+        if (group_ports(ports, count, group == BAUDRATE_NOW ? when : group,
+                        1, &skew))
+            group = -1;
+    } else if (all_or_nothing) {
+        grouped = 1;
+        group_ports(ports, count, when, 0, &skew);
+    } else if (jobs > 1 && count > 1) {
+        /* Configure ports in parallel, results are still printed in order */
+        threads = calloc(jobs < count ? jobs : count, sizeof(*threads));
+        if (!threads) {
+            perror("calloc");
+            exit(EXIT_FAILURE);
+        }
+        nthreads = start_workers(threads, jobs, ports, count);
+    }
+
+    for (i = 0; i < count; i++) {
+        if (nthreads)
+            wait_port(&ports[i]);
+        else if (!grouped)
+            ports[i].rc = configure_port(&ports[i]);
+        if (verify >= 0 && !ports[i].rc && ports[i].set)
+            ports[i].rc = verify_port(&ports[i]);
+        if (ports[i].rc)
+            ret = EXIT_FAILURE;
+        else if (verify >= 0 && ports[i].set && !ports[i].verified &&
+                 ret == EXIT_SUCCESS)
+            ret = EXIT_VERIFY;
+        print_port(&ports[i], batch);
+        if (state_path && !ports[i].rc && ports[i].set &&
+            state_update(&st, &ports[i]))
+            ret = EXIT_FAILURE;
+        if (probe && !ports[i].rc &&
+            probe_port(&ports[i], state_path ? &st : NULL))
+            ret = EXIT_FAILURE;
+        if (list_rates && !ports[i].rc &&
+            list_rates_port(&ports[i], list_min, list_max))
+            ret = EXIT_FAILURE;
+        if (bench && !ports[i].rc && bench_port(&ports[i], peer, bench))
+            ret = EXIT_FAILURE;
+        if (latency && !ports[i].rc &&
+            latency_port(&ports[i], peer, latency, frame_size, low_latency))
+            ret = EXIT_FAILURE;
+    }
+
+    for (i = 0; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+
+    if (group >= 0)
+        print_group(&skew, count);
+
+    if (trace_timing && batch)
+        print_trace_drivers();
+
+    if (state_path)
+        state_close(&st);
+
+    /* Sampling is driven by one epoll loop, so without -j all ports are
+       sampled at once instead of one after another */
+    if (autodetect && autodetect_ports(ports, count, jobs ? jobs : count,
+                                       rates, nrates))
+        ret = EXIT_FAILURE;
+
+    /* Child gets either all requested ports or nothing */
+    if (cmd) {
+        if (ret != EXIT_SUCCESS || exec_ports(ports, count, cmd))
+            exit(EXIT_FAILURE);
+    }
+
+    if (watch) {
+        fflush(stdout);
+        if (watch_ports(ports, count, watch))
+            exit(EXIT_FAILURE);
+    } else if (hold) {
+        fflush(stdout);
+        if (hold_ports())
+            exit(EXIT_FAILURE);
+    }
 
-    close(fd);
-    exit(EXIT_SUCCESS);
+    exit(ret);
 }
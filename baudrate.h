@@ -0,0 +1,247 @@
+/* SPDX-FileCopyrightText: 2021 Pali Rohár <pali@kernel.org> */
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+#ifndef BAUDRATE_H
+#define BAUDRATE_H
+
+#include <stddef.h> /* for size_t */
+
+/* Returned baud rate when it cannot be determined */
+#define BAUDRATE_UNKNOWN ((unsigned int)-1)
+
+/*
+ * All functions operate on an already opened serial port fd and return 0
+ * on success or -1 on failure with errno set. EINVAL is returned for baud
+ * rates which cannot be configured and EOPNOTSUPP when split input and
+ * output baud rates are not supported.
+ */
+
+/* Get the current output and input baud rates */
+int baudrate_get(int fd, unsigned int *output, unsigned int *input);
+
+/* Detailed baud rate configuration, raw values are taken from kernel */
+struct baudrate_info {
+    unsigned int output;
+    unsigned int input;
+    unsigned int cbaud; /* c_cflag & CBAUD */
+    unsigned int cibaud; /* input CBAUD bits, B0 means same as output */
+    int bother; /* non-zero when BOTHER is used for output or input */
+    int serial; /* non-zero when following TIOCGSERIAL fields are valid */
+    int spd_flags; /* serial_struct flags & ASYNC_SPD_MASK */
+    int custom_divisor;
+    int baud_base;
+    /* New fields are appended, so existing ones keep their offsets */
+    unsigned int char_bits; /* start, data, parity and stop bits */
+};
+
+/* Like baudrate_get() but fill also raw termios and serial_struct values,
+   this always issues TIOCGSERIAL */
+int baudrate_get_info(int fd, struct baudrate_info *info);
+
+/* Line timing for sizing protocol timers, all times are rounded up. Gaps
+   are the Modbus RTU t1.5 and t3.5 computed from character time, Modbus
+   also allows fixed 750 us and 1750 us above 19200 baud */
+struct baudrate_timing {
+    unsigned int rate;
+    unsigned int char_bits;
+    unsigned long long bit_ns;
+    unsigned long long char_ns;
+    unsigned long long gap15_ns; /* 1.5 characters, inter-character timeout */
+    unsigned long long gap35_ns; /* 3.5 characters, inter-frame gap */
+    unsigned int vtime; /* smallest non-zero VTIME covering gap15_ns */
+};
+
+/* Compute timing of rate and char_bits from baudrate_info, EINVAL for
+   zero or unknown rate */
+int baudrate_timing(unsigned int rate, unsigned int char_bits,
+                    struct baudrate_timing *timing);
+
+/* Timing of the currently configured output baud rate and c_cflag */
+int baudrate_get_timing(int fd, struct baudrate_timing *timing);
+
+/* Set output and input baud rates, pass the same value for both to
+   configure input baud rate to the output baud rate */
+int baudrate_set(int fd, unsigned int output, unsigned int input);
+
+/* Like baudrate_set() but also return baud rates which were really
+   configured by kernel, no change is done when they already match. Change
+   is written with BAUDRATE_NOW, so it never waits for pending output */
+int baudrate_change(int fd, unsigned int output, unsigned int input,
+                    unsigned int *cur_output, unsigned int *cur_input);
+
+/* Port settings applied together with baud rate, -1 keeps current value */
+struct baudrate_opts {
+    int low_latency; /* ASYNC_LOW_LATENCY flag of serial_struct */
+    int vmin; /* VMIN of c_cc */
+    int vtime; /* VTIME of c_cc in deciseconds */
+    int latency_timer; /* USB serial latency timer in ms via sysfs */
+    int rx_trigger; /* UART RX FIFO trigger level in bytes via sysfs */
+    int rs485_delay; /* RTS delays around send in character times of the
+                        new baud rate via TIOCSRS485, read back rounded */
+};
+
+/* Set all fields of opts to keep current values */
+void baudrate_opts_init(struct baudrate_opts *opts);
+
+/* Like baudrate_change() but apply also opts, serial_struct and termios
+   changes are written by one TIOCSSERIAL and one TCSETS2 call and all of
+   them are read back, EPROTO is returned when driver did not accept them;
+   low_latency without serial_struct and sysfs attributes missing for the
+   driver are skipped, rs485_delay fails with ENOTTY without RS-485 */
+int baudrate_change_opts(int fd, unsigned int output, unsigned int input,
+                         const struct baudrate_opts *opts,
+                         unsigned int *cur_output, unsigned int *cur_input);
+
+/* How pending data are handled when new settings are written */
+#define BAUDRATE_NOW 0 /* apply immediately */
+#define BAUDRATE_DRAIN 1 /* wait until output is transmitted */
+#define BAUDRATE_FLUSH 2 /* drain output and discard pending input */
+
+/* Change of one port split into slow and fast part, so a group of ports
+   can be switched at the same moment */
+struct baudrate_prepared;
+
+/* Read settings and compute new ones like baudrate_change_opts(), opts may
+   be NULL. Nothing is written yet, release prep by baudrate_prepared_free() */
+int baudrate_prepare(int fd, unsigned int output, unsigned int input,
+                     const struct baudrate_opts *opts,
+                     struct baudrate_prepared **prep);
+
+/* Write prepared change as one TIOCSSERIAL and one TCSETS2, TCSETSW2 or
+   TCSETSF2 call selected by when, then read back and verify it. When any
+   step fails, termios and serial_struct snapshot taken by prepare is
+   written back */
+int baudrate_commit(struct baudrate_prepared *prep, int when,
+                    unsigned int *cur_output, unsigned int *cur_input);
+
+/* Undo successfully committed change by writing the snapshot back, e.g.
+   when other port of the same group failed */
+int baudrate_rollback(struct baudrate_prepared *prep);
+
+/* Seconds spent by TCSETS2, TCSETSW2 or TCSETSF2 call of last commit, so
+   waiting for output to drain without reading and verifying settings, 0
+   when termios did not change */
+double baudrate_commit_seconds(const struct baudrate_prepared *prep);
+
+void baudrate_prepared_free(struct baudrate_prepared *prep);
+
+/* Cached settings of one open fd with prebuilt baud rate presets, so
+   switching between them needs no reads, lookups or allocations */
+struct baudrate_session;
+
+/* Read settings of fd, release session by baudrate_session_free() */
+int baudrate_session_new(int fd, struct baudrate_session **session);
+
+/* Build preset for output and input baud rates from cached settings and
+   return its index or -1 with errno, nothing is written */
+int baudrate_session_add(struct baudrate_session *session, unsigned int output,
+                         unsigned int input);
+
+/* Switch to preset by one TCSETS2, TCSETSW2 or TCSETSF2 call selected by
+   when. TIOCSSERIAL is needed only for custom rates without BOTHER and
+   when switching back from them. Nothing is read back, baudrate_get()
+   tells which rates driver really uses */
+int baudrate_session_switch(struct baudrate_session *session, int preset,
+                            int when);
+
+/* Read settings again and rebuild presets, needed when settings other
+   than baud rate were changed outside of session */
+int baudrate_session_refresh(struct baudrate_session *session);
+
+void baudrate_session_free(struct baudrate_session *session);
+
+/* Get current values of all opts fields, -1 when unsupported */
+int baudrate_get_opts(int fd, struct baudrate_opts *opts);
+
+/* Find baud rate closest to n which port can really achieve and its error
+   in ppm. It is computed from baud_base and 16-bit divisor for 8250 class
+   UARTs, other ports are configured to n, read back and restored */
+int baudrate_best_fit(int fd, unsigned int n, unsigned int *rate, long *ppm);
+
+/* Support of baud rate without Bnnn constant */
+#define BAUDRATE_CAP_NO 0
+#define BAUDRATE_CAP_ROUNDED 1 /* accepted, but driver chose other rate */
+#define BAUDRATE_CAP_EXACT 2
+
+/* Capabilities of port found by baudrate_probe() */
+struct baudrate_caps {
+    /* Bit i is set when driver accepts i-th rate of
+       baudrate_list_standard(), even when it rounds it */
+    unsigned long long standard;
+    int bother; /* BAUDRATE_CAP_* */
+    int split; /* different input and output baud rates */
+    unsigned int baud_base; /* 0 unless 8250 class UART with divisor */
+    unsigned int min_divisor_rate; /* lowest rate of 16-bit divisor */
+    unsigned long long standard_exact; /* bits of standard read back as is */
+};
+
+/* Characterise port by trying baud rates, then restore its settings */
+int baudrate_probe(int fd, struct baudrate_caps *caps);
+
+/* Check from probed caps whether setting rates can succeed, return 1 or 0
+   with errno set to error which baudrate_change() would fail with. Rounded
+   rates are accepted, like baudrate_change() does */
+int baudrate_caps_supported(const struct baudrate_caps *caps,
+                            unsigned int output, unsigned int input);
+
+/* Fill rates with up to size exact baud rates between min and max in
+   increasing order. They are computed from baud_base for 8250 class
+   UARTs, otherwise found by bisection over rounding done by driver
+   and port settings are restored. Return 0, 1 when rates did not fit, or
+   -1 with errno */
+int baudrate_list_rates(int fd, unsigned int min, unsigned int max,
+                        unsigned int *rates, size_t size, size_t *count);
+
+/* Get or set raw termios by the same traced ioctl and backend which other
+   functions use, tio is struct termios2 when <asm/ioctls.h> defines
+   TCGETS2 and struct termios otherwise, when is BAUDRATE_* */
+int baudrate_get_termios(int fd, void *tio);
+int baudrate_set_termios(int fd, int when, const void *tio);
+
+/* Discard pending data via backend, queue is TCIFLUSH, TCOFLUSH or
+   TCIOFLUSH */
+int baudrate_flush(int fd, int queue);
+
+/* Get line error counters via backend, ENOTTY when driver does not count
+   them */
+struct serial_icounter_struct;
+int baudrate_get_icount(int fd, struct serial_icounter_struct *icount);
+
+/* Get or set ASYNC_LOW_LATENCY flag of serial_struct */
+int baudrate_get_low_latency(int fd, int *enabled);
+int baudrate_set_low_latency(int fd, int enabled);
+
+/* Operations reported to trace callback, TCSETS covers also variants
+   which drain or flush */
+#define BAUDRATE_TRACE_TCGETS 0
+#define BAUDRATE_TRACE_TCSETS 1
+#define BAUDRATE_TRACE_TIOCGSERIAL 2
+#define BAUDRATE_TRACE_TIOCSSERIAL 3
+#define BAUDRATE_TRACE_TIOCGRS485 4
+#define BAUDRATE_TRACE_TIOCSRS485 5
+#define BAUDRATE_TRACE_OPS 6
+
+/* Called after every ioctl issued by library with its CLOCK_MONOTONIC
+   duration and return value, possibly from multiple threads */
+typedef void (*baudrate_trace_fn)(void *ctx, int fd, int op,
+                                  double seconds, int rc);
+
+/* Install trace callback, NULL disables tracing */
+void baudrate_set_trace(baudrate_trace_fn fn, void *ctx);
+
+/* Name of ioctl of trace operation as used by this build */
+const char *baudrate_trace_name(int op);
+
+/* Performs ioctls of library instead of ioctl(), e.g. simulated driver
+   for testing without hardware, returns 0 or -1 with errno */
+typedef int (*baudrate_ioctl_fn)(void *ctx, int fd, unsigned long request,
+                                 void *arg);
+
+/* Install ioctl backend, NULL restores kernel ioctl(). It is not changed
+   atomically, so it has to be installed before any other call */
+void baudrate_set_backend(baudrate_ioctl_fn fn, void *ctx);
+
+/* Get list of baud rates which have Bnnn constant, including 0 */
+size_t baudrate_list_standard(const unsigned int **rates);
+
+#endif
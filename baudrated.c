@@ -0,0 +1,316 @@
+/* SPDX-FileCopyrightText: 2021 Pali Rohár <pali@kernel.org> */
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+#define _POSIX_C_SOURCE 200809L /* for O_CLOEXEC */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h> /* for open() */
+#include <signal.h> /* for sigprocmask() */
+#include <unistd.h> /* for close(), unlink() */
+#include <sys/epoll.h> /* for epoll_*() */
+#include <sys/signalfd.h> /* for signalfd() */
+#include <sys/socket.h> /* for socket(), bind(), accept() */
+#include <sys/un.h> /* for struct sockaddr_un */
+
+#include "baudrate.h"
+#include "baudrated.h"
+#include "trace.h"
+
+/* Managed port, kept open for the whole life of daemon */
+struct port {
+    const char *dev;
+    int fd; /* -1 when open failed, retried by next request */
+};
+
+static struct port *ports;
+static unsigned int nports;
+
+/* Keep ioctl timing histograms per driver, selected by -t */
+static int trace_timing;
+
+/* Epoll data of listening and signal fds, clients use their fd number */
+#define EV_LISTEN ((uint64_t)-1)
+#define EV_SIGNAL ((uint64_t)-2)
+
+static int
+open_port(struct port *p)
+{
+    if (p->fd < 0) {
+        p->fd = open(p->dev, O_RDWR | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
+        if (p->fd >= 0 && trace_timing)
+            trace_attach(p->fd, NULL);
+    }
+
+    return p->fd;
+}
+
+/* Errors of unplugged device, fd has to be opened again */
+static int
+is_gone(int err)
+{
+    return err == EIO || err == ENODEV || err == ENXIO;
+}
+
+/* Fill timing fields of reply, they stay zero for B0 */
+static int
+get_timing(int fd, struct baudrated_reply *rep)
+{
+    struct baudrate_timing timing;
+
+    if (baudrate_get_timing(fd, &timing))
+        return errno == EINVAL ? 0 : -1;
+
+    rep->char_bits = timing.char_bits;
+    rep->vtime = timing.vtime;
+    rep->bit_ns = timing.bit_ns;
+    rep->char_ns = timing.char_ns;
+    rep->gap15_ns = timing.gap15_ns;
+    rep->gap35_ns = timing.gap35_ns;
+    return 0;
+}
+
+static int
+run_request(struct port *p, const struct baudrated_request *req,
+            struct baudrated_reply *rep)
+{
+    unsigned int output, input;
+    int retry = 1, rc;
+
+    for (;;) {
+        if (open_port(p) < 0)
+            return -1;
+
+        /* Written with BAUDRATE_NOW, output pending on a port stopped by
+           flow control would otherwise stall all clients of event loop */
+        if (req->op == BAUDRATED_SET)
+            rc = baudrate_change(p->fd, req->output, req->input,
+                                 &output, &input);
+        else
+            rc = baudrate_get(p->fd, &output, &input);
+        if (rc == 0 && req->op == BAUDRATED_TIMING)
+            rc = get_timing(p->fd, rep);
+        if (rc == 0)
+            break;
+
+        if (!retry || !is_gone(errno))
+            return -1;
+        if (trace_timing)
+            trace_detach(p->fd);
+        close(p->fd);
+        p->fd = -1;
+        retry = 0;
+    }
+
+    rep->output = output;
+    rep->input = input;
+    return 0;
+}
+
+/* Handle one packet of requests, return -1 when client has to be dropped */
+static int
+handle_client(int fd)
+{
+    struct baudrated_request reqs[BAUDRATED_MAX_BATCH];
+    struct baudrated_reply reps[BAUDRATED_MAX_BATCH];
+    ssize_t len;
+    size_t i, n;
+
+    len = recv(fd, reqs, sizeof(reqs), MSG_DONTWAIT | MSG_TRUNC);
+    if (len < 0)
+        return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+    if (len == 0 || len > (ssize_t)sizeof(reqs) || len % sizeof(*reqs))
+        return -1;
+
+    n = len / sizeof(*reqs);
+    for (i = 0; i < n; i++) {
+        memset(&reps[i], 0, sizeof(reps[i]));
+        reps[i].id = reqs[i].id;
+        reps[i].output = BAUDRATE_UNKNOWN;
+        reps[i].input = BAUDRATE_UNKNOWN;
+        if (reqs[i].port >= nports ||
+            (reqs[i].op != BAUDRATED_GET && reqs[i].op != BAUDRATED_SET &&
+             reqs[i].op != BAUDRATED_TIMING))
+            reps[i].error = EINVAL;
+        else if (run_request(&ports[reqs[i].port], &reqs[i], &reps[i]))
+            reps[i].error = errno;
+    }
+
+    if (send(fd, reps, n * sizeof(*reps), MSG_NOSIGNAL) < 0)
+        return -1;
+
+    return 0;
+}
+
+static int
+open_socket(const char *path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+
+    /* Socket left by previous instance which was killed */
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(fd, 16)) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static int
+add_fd(int epfd, int fd, uint64_t data)
+{
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN;
+    ev.data.u64 = data;
+    return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static void
+print_trace(void)
+{
+    struct trace_summary sum;
+    size_t i;
+
+    for (i = 0; trace_summary(i, &sum) == 0; i++)
+        fprintf(stderr, "driver %s %s: %lu calls, p50 %.3f us, p99 %.3f us\n",
+                sum.driver, baudrate_trace_name(sum.op), sum.count,
+                sum.p50, sum.p99);
+}
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-s socket] [-t] device...\n"
+            "Options:\n"
+            "  -s socket   path of UNIX socket, default " BAUDRATED_SOCKET "\n"
+            "  -t          keep ioctl timing per driver, printed on SIGUSR1 and exit\n",
+            prog);
+    exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char *argv[])
+{
+    const char *path = BAUDRATED_SOCKET;
+    struct epoll_event evs[16];
+    int lfd, sfd, epfd, fd, n, i, opt;
+    struct signalfd_siginfo si;
+    sigset_t set;
+    unsigned int j;
+
+    while ((opt = getopt(argc, argv, "s:t")) != -1) {
+        switch (opt) {
+        case 's':
+            path = optarg;
+            break;
+        case 't':
+            trace_timing = 1;
+            trace_enable();
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (optind >= argc)
+        usage(argv[0]);
+
+    nports = argc - optind;
+    ports = calloc(nports, sizeof(*ports));
+    if (!ports) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Device which is not present yet is opened by first request */
+    for (j = 0; j < nports; j++) {
+        ports[j].dev = argv[optind + j];
+        ports[j].fd = -1;
+        if (open_port(&ports[j]) < 0)
+            fprintf(stderr, "%s: %s\n", ports[j].dev, strerror(errno));
+    }
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGUSR1);
+    if (sigprocmask(SIG_BLOCK, &set, NULL)) {
+        perror("sigprocmask");
+        exit(EXIT_FAILURE);
+    }
+
+    lfd = open_socket(path);
+    if (lfd < 0) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    sfd = signalfd(-1, &set, SFD_CLOEXEC);
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (sfd < 0 || epfd < 0 || add_fd(epfd, lfd, EV_LISTEN) ||
+        add_fd(epfd, sfd, EV_SIGNAL)) {
+        perror("epoll");
+        unlink(path);
+        exit(EXIT_FAILURE);
+    }
+
+    for (;;) {
+        n = epoll_wait(epfd, evs, sizeof(evs) / sizeof(*evs), -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            break;
+        }
+
+        for (i = 0; i < n; i++) {
+            if (evs[i].data.u64 == EV_SIGNAL) {
+                if (read(sfd, &si, sizeof(si)) == sizeof(si) &&
+                    si.ssi_signo == SIGUSR1) {
+                    print_trace();
+                    continue;
+                }
+                goto out;
+            }
+
+            if (evs[i].data.u64 == EV_LISTEN) {
+                fd = accept(lfd, NULL, NULL);
+                if (fd >= 0 && add_fd(epfd, fd, fd))
+                    close(fd);
+                continue;
+            }
+
+            /* Closing fd removes it from epoll set too */
+            fd = evs[i].data.u64;
+            if ((evs[i].events & EPOLLIN) ? handle_client(fd) :
+                (evs[i].events & (EPOLLHUP | EPOLLERR)) != 0)
+                close(fd);
+        }
+    }
+
+out:
+    if (trace_timing)
+        print_trace();
+    unlink(path);
+    exit(EXIT_SUCCESS);
+}
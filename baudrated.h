@@ -0,0 +1,51 @@
+/* SPDX-FileCopyrightText: 2021 Pali Rohár <pali@kernel.org> */
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+#ifndef BAUDRATED_H
+#define BAUDRATED_H
+
+#include <stdint.h> /* for uint32_t, int32_t, uint64_t */
+
+/*
+ * Protocol of baudrated daemon. Client connects to SOCK_SEQPACKET UNIX
+ * socket and sends packets, each one is array of up to BAUDRATED_MAX_BATCH
+ * requests. For every packet daemon sends one packet with array of replies
+ * in the same order. Client does not have to wait for reply before sending
+ * next packet, replies can be matched by id. All fields are in native byte
+ * order. Port is index of device in daemon command line, starting at 0.
+ */
+
+#define BAUDRATED_SOCKET "/run/baudrated.sock"
+
+#define BAUDRATED_MAX_BATCH 64
+
+/* Request operations */
+#define BAUDRATED_GET 1 /* read current baud rates */
+#define BAUDRATED_SET 2 /* set output and input baud rates */
+#define BAUDRATED_TIMING 3 /* read baud rates and line timing, batch it after
+                              BAUDRATED_SET to get timing of the new rate */
+
+struct baudrated_request {
+    uint32_t id; /* chosen by client, copied to reply */
+    uint32_t op;
+    uint32_t port;
+    uint32_t output; /* only for BAUDRATED_SET */
+    uint32_t input;
+};
+
+struct baudrated_reply {
+    uint32_t id;
+    int32_t error; /* 0 on success or errno value */
+    uint32_t output; /* current baud rates, BAUDRATE_UNKNOWN when unknown */
+    uint32_t input;
+    /* Following fields are filled only by BAUDRATED_TIMING, see struct
+       baudrate_timing */
+    uint32_t char_bits;
+    uint32_t vtime;
+    uint64_t bit_ns;
+    uint64_t char_ns;
+    uint64_t gap15_ns;
+    uint64_t gap35_ns;
+};
+
+#endif
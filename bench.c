@@ -0,0 +1,282 @@
+/* SPDX-FileCopyrightText: 2021 Pali Rohár <pali@kernel.org> */
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <poll.h> /* for poll() */
+#include <unistd.h> /* for read(), write() */
+
+#include <asm/termbits.h> /* for TCIFLUSH */
+
+#include "baudrate.h"
+#include "bench.h"
+#include "tio.h"
+
+/* Stop waiting for remaining bytes when none arrived for this time */
+#define BENCH_IDLE_MS 500
+
+/* Consider latency frame lost when it did not come back in this time */
+#define LATENCY_TIMEOUT_MS 1000
+
+/* Largest frame for latency measurement */
+#define LATENCY_MAX_SIZE 4096
+
+static int
+bench_loop(int tx, int rx, unsigned char mask, unsigned int ms,
+           struct bench_result *res)
+{
+    unsigned char buf[4096], next_tx = 0, next_rx = 0;
+    double start, end, last_rx, t;
+    struct pollfd pfd[2];
+    ssize_t len, i;
+    int sending;
+
+    start = tio_now();
+    end = start + ms / 1000.0;
+    last_rx = start;
+
+    for (;;) {
+        t = tio_now();
+        sending = t < end;
+        if (!sending && (res->received >= res->sent ||
+                         t - (last_rx > end ? last_rx : end) > BENCH_IDLE_MS / 1000.0))
+            break;
+
+        pfd[0].fd = tx;
+        pfd[0].events = sending ? POLLOUT : 0;
+        pfd[1].fd = rx;
+        pfd[1].events = POLLIN;
+        if (poll(pfd, 2, 10) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        if (pfd[0].revents & POLLOUT) {
+            for (i = 0; i < (ssize_t)sizeof(buf); i++)
+                buf[i] = (next_tx + i) & mask;
+            len = write(tx, buf, sizeof(buf));
+            if (len < 0 && errno != EAGAIN && errno != EINTR)
+                return -1;
+            if (len > 0) {
+                next_tx += len;
+                res->sent += len;
+            }
+        }
+
+        if (pfd[1].revents & POLLIN) {
+            len = read(rx, buf, sizeof(buf));
+            if (len < 0 && errno != EAGAIN && errno != EINTR)
+                return -1;
+            for (i = 0; i < len; i++) {
+                /* Resynchronize on the received byte after error */
+                if (buf[i] != (next_rx & mask)) {
+                    res->errors++;
+                    next_rx = buf[i];
+                }
+                next_rx++;
+            }
+            if (len > 0) {
+                res->received += len;
+                last_rx = tio_now();
+            }
+        }
+    }
+
+    res->seconds = last_rx - start;
+    return 0;
+}
+
+/* Change both ports to raw mode, undone by restore_raw() */
+static int
+prepare_raw(int tx, int rx, tio_t *tx_saved, tio_t *rx_saved)
+{
+    int err;
+
+    if (tio_set_raw(tx, tx_saved))
+        return -1;
+    if (rx != tx && tio_set_raw(rx, rx_saved)) {
+        err = errno;
+        tio_set(tx, tx_saved);
+        errno = err;
+        return -1;
+    }
+
+    return 0;
+}
+
+static void
+restore_raw(int tx, int rx, const tio_t *tx_saved, const tio_t *rx_saved)
+{
+    int err = errno;
+
+    tio_set(tx, tx_saved);
+    if (rx != tx)
+        tio_set(rx, rx_saved);
+    errno = err;
+}
+
+int
+bench_run(int tx, int rx, unsigned int ms, struct bench_result *res)
+{
+    struct baudrate_info info;
+    tio_t tx_saved, rx_saved;
+    int rc;
+
+    memset(res, 0, sizeof(*res));
+
+    if (baudrate_get_info(tx, &info))
+        return -1;
+    if (info.output != BAUDRATE_UNKNOWN && info.char_bits)
+        res->line_rate = (double)info.output / info.char_bits;
+
+    if (prepare_raw(tx, rx, &tx_saved, &rx_saved))
+        return -1;
+
+    rc = bench_loop(tx, rx, tio_data_mask(&tx_saved), ms, res);
+
+    if (res->seconds > 0)
+        res->rate = res->received / res->seconds;
+
+    restore_raw(tx, rx, &tx_saved, &rx_saved);
+    return rc;
+}
+
+/* Send one frame and wait until it is received back, return round-trip
+   time in seconds, 0 when frame was lost or -1 on failure */
+static double
+latency_frame(int tx, int rx, const unsigned char *frame, size_t size,
+              int *corrupted)
+{
+    unsigned char buf[LATENCY_MAX_SIZE];
+    double start, elapsed;
+    struct pollfd pfd;
+    size_t done = 0;
+    ssize_t len;
+    int timeout;
+
+    start = tio_now();
+    while (done < size) {
+        len = write(tx, frame + done, size - done);
+        if (len < 0 && errno == EAGAIN) {
+            /* Wait until driver makes room in output buffer */
+            timeout = LATENCY_TIMEOUT_MS - (int)((tio_now() - start) * 1000);
+            if (timeout <= 0)
+                return 0;
+            pfd.fd = tx;
+            pfd.events = POLLOUT;
+            if (poll(&pfd, 1, timeout) < 0 && errno != EINTR)
+                return -1;
+            continue;
+        }
+        if (len < 0 && errno != EINTR)
+            return -1;
+        if (len > 0)
+            done += len;
+    }
+
+    done = 0;
+    *corrupted = 0;
+    while (done < size) {
+        elapsed = tio_now() - start;
+        timeout = LATENCY_TIMEOUT_MS - (int)(elapsed * 1000);
+        if (timeout <= 0)
+            return 0;
+
+        pfd.fd = rx;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, timeout) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (!(pfd.revents & POLLIN))
+            continue;
+
+        len = read(rx, buf + done, size - done);
+        if (len < 0 && errno != EAGAIN && errno != EINTR)
+            return -1;
+        if (len > 0)
+            done += len;
+    }
+
+    if (memcmp(buf, frame, size) != 0)
+        *corrupted = 1;
+
+    return tio_now() - start;
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+int
+latency_run(int tx, int rx, unsigned int count, unsigned int size,
+            struct latency_result *res)
+{
+    unsigned char frame[LATENCY_MAX_SIZE], mask;
+    tio_t tx_saved, rx_saved;
+    double *samples, t;
+    unsigned int i, j;
+    int corrupted;
+    int rc = 0;
+
+    memset(res, 0, sizeof(*res));
+
+    if (size == 0 || size > LATENCY_MAX_SIZE || count == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    samples = malloc(count * sizeof(*samples));
+    if (!samples)
+        return -1;
+
+    if (prepare_raw(tx, rx, &tx_saved, &rx_saved)) {
+        free(samples);
+        return -1;
+    }
+
+    mask = tio_data_mask(&tx_saved);
+    for (i = 0; i < count; i++) {
+        for (j = 0; j < size; j++)
+            frame[j] = (i + j) & mask;
+
+        t = latency_frame(tx, rx, frame, size, &corrupted);
+        if (t < 0) {
+            rc = -1;
+            break;
+        }
+        if (t == 0) {
+            /* Late bytes of lost frame would be matched with next one */
+            res->lost++;
+            if (baudrate_flush(rx, TCIFLUSH)) {
+                rc = -1;
+                break;
+            }
+            continue;
+        }
+        if (corrupted)
+            res->errors++;
+        samples[res->count++] = t * 1e6;
+    }
+
+    restore_raw(tx, rx, &tx_saved, &rx_saved);
+
+    if (res->count) {
+        qsort(samples, res->count, sizeof(*samples), cmp_double);
+        res->min = samples[0];
+        res->median = samples[res->count / 2];
+        res->p99 = samples[(res->count * 99 - 1) / 100];
+        res->max = samples[res->count - 1];
+    }
+
+    free(samples);
+    return rc;
+}
@@ -0,0 +1,44 @@
+/* SPDX-FileCopyrightText: 2021 Pali Rohár <pali@kernel.org> */
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+/* Result of throughput benchmark */
+struct bench_result {
+    unsigned long long sent; /* bytes written */
+    unsigned long long received; /* bytes read back */
+    unsigned long errors; /* received bytes not matching pattern */
+    double seconds; /* time from first write to last received byte */
+    double rate; /* received bytes per second */
+    double line_rate; /* theoretical bytes per second at configured baud rate */
+};
+
+/*
+ * Write timed pattern to tx fd for ms milliseconds and verify it on rx fd,
+ * which is the same fd for loopback plug. Both ports are switched to raw
+ * mode for the benchmark and their termios is restored afterwards. Return 0
+ * on success or -1 with errno set.
+ */
+int bench_run(int tx, int rx, unsigned int ms, struct bench_result *res);
+
+/* Result of round-trip latency measurement, times are in microseconds */
+struct latency_result {
+    unsigned int count; /* frames which came back */
+    unsigned int lost; /* frames which did not come back in time */
+    unsigned int errors; /* frames which came back corrupted */
+    double min;
+    double median;
+    double p99;
+    double max;
+};
+
+/*
+ * Send count frames of size bytes one by one to tx fd and measure time
+ * until each is received back on rx fd. Ports are switched to raw mode like
+ * for bench_run(). Return 0 on success or -1 with errno set.
+ */
+int latency_run(int tx, int rx, unsigned int count, unsigned int size,
+                struct latency_result *res);
+
+#endif
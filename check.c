@@ -0,0 +1,664 @@
+/* SPDX-FileCopyrightText: 2021 Pali Rohár <pali@kernel.org> */
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+/*
+ * Tests run by "make check" without any serial hardware: properties of
+ * rate arithmetic, get/set round trips through the simulated driver, the
+ * fuzz target fed by pseudo-random inputs and a throughput benchmark.
+ * With -DFUZZ it is a libFuzzer target which runs the fixed checks from
+ * LLVMFuzzerInitialize() and aborts on the first failed one.
+ */
+
+#define _POSIX_C_SOURCE 200809L /* for clock_gettime() in tio.h users */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h> /* for close() */
+
+#include <linux/serial.h> /* for struct serial_icounter_struct */
+
+#include "baudrate.h"
+#include "rates.h"
+#include "sim.h"
+#include "tio.h"
+
+#define NSTANDARD (sizeof(standard_rates)/sizeof(standard_rates[0]))
+
+#ifdef FUZZ
+#define CHECK(cond) do { if (!(cond)) abort(); } while (0)
+#else
+static unsigned long failures;
+
+static void
+check_failed(int line, const char *cond)
+{
+    fprintf(stderr, "check.c:%d: check failed: %s\n", line, cond);
+    failures++;
+}
+
+#define CHECK(cond) do { if (!(cond)) check_failed(__LINE__, #cond); } while (0)
+#endif
+
+/* Rates around 0, UINT_MAX, Bnnn constants and 16-bit divisor limits */
+static const unsigned int edge_rates[] = {
+    0, 1, 2, 3, 7, 28, 29, 45, 46, 49, 50, 51, 9599, 9600, 9601, 9615,
+    38400, 250000, 1843199, 1843200, 1843201, 4000000, 4000001,
+    INT_MAX - 1, INT_MAX, (unsigned int)INT_MAX + 1, UINT_MAX / 2 + 1,
+    UINT_MAX - 2, UINT_MAX - 1, UINT_MAX,
+};
+
+/* UART clocks, most of them are not divisible by common rates */
+static const int edge_bases[] = {
+    -1, 0, 1, 2, 3, 115200, 1843200, 3000000, 24000000, INT_MAX - 1, INT_MAX,
+};
+
+/* Simulated drivers of round trip tests and fuzz target */
+static const struct sim_config sim_configs[] = {
+    { 0, SIM_ROUND_EXACT, 0 },
+    { 1843200, SIM_ROUND_EXACT, 0 },
+    { 3000000, SIM_ROUND_DIVISOR, 0 },
+    { 1843200, SIM_ROUND_DIVISOR, 0 },
+    { 0, SIM_ROUND_STANDARD, 0 },
+    { 1843200, SIM_ROUND_STANDARD, 0 },
+};
+
+#define NCONFIGS (sizeof(sim_configs)/sizeof(sim_configs[0]))
+
+static int
+is_standard(unsigned int n)
+{
+    size_t i;
+
+    for (i = 0; i < NSTANDARD; i++)
+        if (standard_rates[i] == n)
+            return 1;
+
+    return 0;
+}
+
+/* Twice the distance of a from b, computed without overflow */
+static unsigned long long
+twice_diff(unsigned long long a, unsigned long long b)
+{
+    return 2 * (a > b ? a - b : b - a);
+}
+
+/* Lookup of any n agrees with the table and Bnnn constants map back */
+static void
+check_map_rate(unsigned int n)
+{
+    tcflag_t bn = map_n_to_bn(n);
+
+    if (is_standard(n))
+        CHECK(map_bn_to_n(bn) == n && (n == 0 || bn != B0));
+    else
+        CHECK(bn == B0);
+}
+
+static void
+check_map(void)
+{
+    size_t i, valid = 0;
+    tcflag_t bn;
+    unsigned int n;
+
+    for (i = 0; i < NSTANDARD; i++)
+        check_map_rate(standard_rates[i]);
+    for (i = 0; i < sizeof(edge_rates)/sizeof(edge_rates[0]); i++)
+        check_map_rate(edge_rates[i]);
+
+    /* Every CBAUD value is either invalid or maps back to itself */
+    for (bn = 0; bn <= CBAUD; bn++) {
+        n = map_bn_to_n(bn);
+        if (n == BAUDRATE_UNKNOWN)
+            continue;
+        CHECK(map_n_to_bn(n) == bn);
+        valid++;
+    }
+    CHECK(valid == NSTANDARD);
+}
+
+/* Divisor for n is nearest to base / n and both directions round trip */
+static void
+check_divisor(int base, unsigned int n)
+{
+    unsigned int r;
+    int d;
+
+    d = rate_divisor(base, n);
+    if (base <= 0 || n == 0) {
+        CHECK(d == 0);
+        return;
+    }
+    if (d == 0) {
+        /* Only rates above twice the clock round to no divisor */
+        CHECK((unsigned long long)base + n/2 < n);
+        return;
+    }
+    CHECK(twice_diff((unsigned long long)d * n, base) <= n);
+
+    r = divisor_rate(base, d);
+    CHECK(twice_diff((unsigned long long)r * d, base) <= (unsigned int)d);
+    if (r == 0)
+        return;
+
+    /* Rate of a divisor is produced again by the divisor chosen for it */
+    CHECK(divisor_rate(base, rate_divisor(base, r)) == r);
+    if ((unsigned long long)d * (d + 1) < (unsigned int)base)
+        CHECK(rate_divisor(base, r) == d);
+}
+
+static void
+check_divisors(void)
+{
+    const unsigned int divisors[] = { 1, 2, 3, 7, 13, 0xfffe, 0xffff, 0x10000 };
+    size_t i, j;
+    unsigned int d;
+    int base;
+
+    for (i = 0; i < sizeof(edge_bases)/sizeof(edge_bases[0]); i++) {
+        base = edge_bases[i];
+        for (j = 0; j < sizeof(edge_rates)/sizeof(edge_rates[0]); j++)
+            check_divisor(base, edge_rates[j]);
+        for (j = 0; j < NSTANDARD; j++)
+            check_divisor(base, standard_rates[j]);
+        if (base <= 0)
+            continue;
+        for (j = 0; j < sizeof(divisors)/sizeof(divisors[0]); j++) {
+            d = divisors[j];
+            check_divisor(base, divisor_rate(base, d));
+        }
+        /* Largest divisor does not overflow */
+        CHECK(divisor_rate(base, UINT_MAX) <= 1);
+    }
+    CHECK(divisor_rate(UINT_MAX, 1) == UINT_MAX);
+}
+
+static void
+check_spd(void)
+{
+    const int spd[] = { ASYNC_SPD_HI, ASYNC_SPD_VHI, ASYNC_SPD_SHI, ASYNC_SPD_WARP };
+    const unsigned int rates[] = { 56000, 115200, 230400, 460800 };
+    const int divisors[] = { 1, 3, 7, 13, 0xffff };
+    struct serial_struct ser;
+    size_t i, j;
+    int base;
+
+    CHECK(get_spd_B38400_alias(NULL) == 38400);
+
+    memset(&ser, 0, sizeof(ser));
+    ser.baud_base = 1843200;
+    ser.custom_divisor = 7;
+    CHECK(get_spd_B38400_alias(&ser) == 38400);
+    for (i = 0; i < sizeof(spd)/sizeof(spd[0]); i++) {
+        ser.flags = spd[i];
+        CHECK(get_spd_B38400_alias(&ser) == rates[i]);
+    }
+
+    ser.flags = ASYNC_SPD_CUST;
+    ser.custom_divisor = 0;
+    CHECK(get_spd_B38400_alias(&ser) == 38400);
+    ser.custom_divisor = -1;
+    CHECK(get_spd_B38400_alias(&ser) == BAUDRATE_UNKNOWN);
+    ser.custom_divisor = 7;
+    ser.baud_base = 0;
+    CHECK(get_spd_B38400_alias(&ser) == BAUDRATE_UNKNOWN);
+
+    /* Custom rate is the nearest one even when base is not divisible */
+    for (i = 0; i < sizeof(edge_bases)/sizeof(edge_bases[0]); i++) {
+        base = edge_bases[i];
+        if (base <= 0)
+            continue;
+        for (j = 0; j < sizeof(divisors)/sizeof(divisors[0]); j++) {
+            ser.baud_base = base;
+            ser.custom_divisor = divisors[j];
+            CHECK(get_spd_B38400_alias(&ser) ==
+                  divisor_rate(base, divisors[j]));
+            CHECK(twice_diff((unsigned long long)get_spd_B38400_alias(&ser) *
+                             divisors[j], base) <= (unsigned int)divisors[j]);
+        }
+    }
+}
+
+/* Rate which simulated driver is expected to use for n */
+static unsigned int
+sim_rate(const struct sim_config *cfg, unsigned int n)
+{
+    int d;
+
+    if (n == 0 || cfg->round != SIM_ROUND_DIVISOR)
+        return n;
+
+    d = rate_divisor(cfg->baud_base, n);
+    if (d < 1)
+        d = 1;
+    if (d > 0xffff)
+        d = 0xffff;
+    return divisor_rate(cfg->baud_base, d);
+}
+
+/* Trace callback counting TIOCSSERIAL calls */
+static void
+count_serial_writes(void *ctx, int fd, int op, double seconds, int rc)
+{
+    (void)fd;
+    (void)seconds;
+    (void)rc;
+
+    if (op == BAUDRATE_TRACE_TIOCSSERIAL)
+        (*(unsigned int *)ctx)++;
+}
+
+/* Set rates and check that driver reports back what library returned */
+static void
+check_sim_change(const struct sim_config *cfg, int fd, unsigned int output,
+                 unsigned int input)
+{
+    unsigned int cur_output, cur_input, get_output, get_input;
+
+    if (baudrate_change(fd, output, input, &cur_output, &cur_input)) {
+        CHECK(errno == EINVAL || errno == EOPNOTSUPP);
+        return;
+    }
+
+    CHECK(baudrate_get(fd, &get_output, &get_input) == 0);
+    CHECK(get_output == cur_output && get_input == cur_input);
+    if (cfg->round != SIM_ROUND_STANDARD) {
+        CHECK(cur_output == sim_rate(cfg, output));
+        CHECK(cur_input == sim_rate(cfg, input));
+    } else {
+        CHECK(is_standard(cur_output) && is_standard(cur_input));
+    }
+}
+
+static void
+check_sim(void)
+{
+    struct serial_icounter_struct icount;
+    struct baudrate_prepared *prep;
+    struct baudrate_opts opts;
+    struct baudrate_caps caps;
+    unsigned int serial_writes;
+    unsigned int output, input, cur_output, cur_input, rate;
+    long ppm;
+    size_t i, j;
+    int fd;
+
+    for (i = 0; i < NCONFIGS; i++) {
+        sim_enable(&sim_configs[i]);
+        fd = sim_open();
+        CHECK(fd >= 0);
+        if (fd < 0)
+            continue;
+
+        for (j = 0; j < sizeof(edge_rates)/sizeof(edge_rates[0]); j++) {
+            check_sim_change(&sim_configs[i], fd, edge_rates[j], edge_rates[j]);
+            check_sim_change(&sim_configs[i], fd, edge_rates[j], 4800);
+        }
+        for (j = 0; j < NSTANDARD; j++)
+            check_sim_change(&sim_configs[i], fd, standard_rates[j],
+                             standard_rates[j]);
+
+        /* Rollback restores rates of the snapshot taken by prepare */
+        CHECK(baudrate_set(fd, 9600, 9600) == 0);
+        CHECK(baudrate_get(fd, &output, &input) == 0);
+        CHECK(baudrate_prepare(fd, 115200, 57600, NULL, &prep) == 0);
+        CHECK(baudrate_commit(prep, BAUDRATE_NOW, &cur_output, &cur_input) == 0);
+        CHECK(baudrate_rollback(prep) == 0);
+        baudrate_prepared_free(prep);
+        CHECK(baudrate_get(fd, &cur_output, &cur_input) == 0);
+        CHECK(cur_output == output && cur_input == input);
+
+        /* Closest rate is found without changing port */
+        CHECK(baudrate_best_fit(fd, 250001, &rate, &ppm) == 0);
+        CHECK(baudrate_get(fd, &cur_output, &cur_input) == 0);
+        CHECK(cur_output == output && cur_input == input);
+        /* Fit computed from baud_base matches only divisor rounding, without
+           baud_base the rate is read back from driver */
+        if (sim_configs[i].round == SIM_ROUND_DIVISOR ||
+            (sim_configs[i].round == SIM_ROUND_EXACT && !sim_configs[i].baud_base))
+            CHECK(rate == sim_rate(&sim_configs[i], 250001));
+
+        /* Delay clamped by driver is rejected, port keeps previous rates */
+        baudrate_opts_init(&opts);
+        opts.rs485_delay = 10;
+        CHECK(baudrate_change_opts(fd, 50, 50, &opts, &cur_output,
+                                   &cur_input) != 0 && errno == EPROTO);
+        CHECK(baudrate_get(fd, &cur_output, &cur_input) == 0);
+        CHECK(cur_output == output && cur_input == input);
+
+        /* Autodetect flushes input and reads line errors via backend */
+        CHECK(baudrate_flush(fd, TCIFLUSH) == 0);
+        CHECK(baudrate_flush(fd, TCIOFLUSH + 1) != 0 && errno == EINVAL);
+        CHECK(baudrate_get_icount(fd, &icount) == 0);
+        CHECK(icount.frame == 0 && icount.parity == 0 && icount.brk == 0);
+
+        /* Probe sets BOTHER rates, so serial_struct needs no restore */
+        serial_writes = 0;
+        baudrate_set_trace(count_serial_writes, &serial_writes);
+        CHECK(baudrate_probe(fd, &caps) == 0);
+        baudrate_set_trace(NULL, NULL);
+#ifdef BOTHER
+        CHECK(serial_writes == 0);
+#endif
+
+        close(fd);
+    }
+
+    baudrate_set_backend(NULL, NULL);
+}
+
+static uint32_t
+get_u32(const uint8_t *data)
+{
+    return data[0] | data[1] << 8 | data[2] << 16 | (uint32_t)data[3] << 24;
+}
+
+/* Byte 0 selects simulated driver, then every 9 bytes are one operation
+   with two 32-bit little-endian rates. Invariants between operations are
+   checked, so crashes and wrong results are both found */
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    const struct sim_config *cfg;
+    struct baudrate_prepared *prep;
+    struct baudrate_session *session;
+    struct baudrate_timing timing;
+    unsigned int a, b, output, input, cur_output, cur_input;
+    unsigned int rate;
+    long ppm;
+    int fd, preset;
+
+    if (size < 1)
+        return 0;
+    cfg = &sim_configs[data[0] % NCONFIGS];
+    sim_enable(cfg);
+    fd = sim_open();
+    if (fd < 0)
+        return 0;
+
+    for (data++, size--; size >= 9; data += 9, size -= 9) {
+        a = get_u32(data + 1);
+        b = get_u32(data + 5);
+
+        switch (data[0] % 6) {
+        case 0:
+            check_sim_change(cfg, fd, a, b);
+            break;
+        case 1:
+            /* Finding closest rate does not change port, it can be set */
+            CHECK(baudrate_get(fd, &output, &input) == 0);
+            if (baudrate_best_fit(fd, a, &rate, &ppm))
+                break;
+            CHECK(baudrate_get(fd, &cur_output, &cur_input) == 0);
+            CHECK(cur_output == output && cur_input == input);
+            CHECK(baudrate_change(fd, rate, rate, &cur_output,
+                                  &cur_input) == 0);
+            break;
+        case 2:
+            /* Commit is all or nothing and rollback undoes it */
+            CHECK(baudrate_get(fd, &output, &input) == 0);
+            if (baudrate_prepare(fd, a, b, NULL, &prep))
+                break;
+            if (baudrate_commit(prep, data[1] % 3, &cur_output, &cur_input) == 0)
+                CHECK(baudrate_rollback(prep) == 0);
+            baudrate_prepared_free(prep);
+            CHECK(baudrate_get(fd, &cur_output, &cur_input) == 0);
+            CHECK(cur_output == output && cur_input == input);
+            break;
+        case 3:
+            check_map_rate(a);
+            check_divisor(a & INT_MAX, b);
+            break;
+        case 4:
+            /* Preset switches to the same rates as baudrate_change() */
+            if (baudrate_session_new(fd, &session))
+                break;
+            preset = baudrate_session_add(session, a, b);
+            if (preset >= 0 &&
+                baudrate_session_switch(session, preset, BAUDRATE_NOW) == 0) {
+                CHECK(baudrate_get(fd, &output, &input) == 0);
+                CHECK(baudrate_change(fd, a, b, &cur_output, &cur_input) == 0);
+                CHECK(cur_output == output && cur_input == input);
+            }
+            baudrate_session_free(session);
+            break;
+        default:
+            if (baudrate_get_timing(fd, &timing))
+                CHECK(errno == EINVAL);
+            else
+                CHECK(timing.char_ns >= timing.bit_ns &&
+                      timing.gap35_ns >= timing.gap15_ns);
+            break;
+        }
+    }
+
+    close(fd);
+    baudrate_set_backend(NULL, NULL);
+    return 0;
+}
+
+#ifdef FUZZ
+/* Fixed checks run once before fuzzing starts */
+int LLVMFuzzerInitialize(int *argc, char ***argv);
+
+int
+LLVMFuzzerInitialize(int *argc, char ***argv)
+{
+    (void)argc;
+    (void)argv;
+
+    check_map();
+    check_divisors();
+    check_spd();
+    check_sim();
+    return 0;
+}
+#else
+/* Table scan which switch lookups of rates.h replaced, kept as baseline */
+static const struct { tcflag_t bn; unsigned int n; } scan_map[] = {
+#define B(n) { B##n, n },
+    MAP(B)
+#undef B
+};
+
+static tcflag_t
+scan_n_to_bn(unsigned int n)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(scan_map)/sizeof(scan_map[0]); i++) {
+        if (scan_map[i].n == n)
+            return scan_map[i].bn;
+    }
+
+    return B0;
+}
+
+static unsigned int
+scan_bn_to_n(tcflag_t bn)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(scan_map)/sizeof(scan_map[0]); i++) {
+        if (scan_map[i].bn == bn)
+            return scan_map[i].n;
+    }
+
+    return BAUDRATE_UNKNOWN;
+}
+
+/* Mix of standard and custom rates, like --list-rates or autodetect */
+static size_t
+lookup_rates(unsigned int *rates, size_t size)
+{
+    size_t i, n = 0;
+
+    for (i = 0; i < NSTANDARD && n + 2 <= size; i++) {
+        rates[n++] = standard_rates[i];
+        rates[n++] = standard_rates[i] + 1;
+    }
+
+    return n;
+}
+
+/* Switches give the same results as the table scan */
+static void
+check_scan(void)
+{
+    unsigned int rates[64];
+    tcflag_t bn;
+    size_t i, n;
+
+    n = lookup_rates(rates, 64);
+    for (i = 0; i < n; i++)
+        CHECK(map_n_to_bn(rates[i]) == scan_n_to_bn(rates[i]));
+    for (bn = 0; bn <= CBAUD; bn++)
+        CHECK(map_bn_to_n(bn) == scan_bn_to_n(bn));
+}
+
+/* Pseudo-random inputs of fuzz target are fixed, so failures reproduce */
+#define FUZZ_RUNS 20000
+#define FUZZ_MAX_SIZE 64
+
+static uint64_t
+xorshift(uint64_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+static void
+check_fuzz(void)
+{
+    uint8_t buf[FUZZ_MAX_SIZE];
+    uint64_t state = 0x9e3779b97f4a7c15ULL, r;
+    size_t i, j, k, size;
+
+    for (i = 0; i < FUZZ_RUNS; i++) {
+        size = xorshift(&state) % (sizeof(buf) + 1);
+        for (j = 0; j < size; j++) {
+            r = xorshift(&state);
+            /* Mostly clear upper bytes of rates, so they are in range of
+               real drivers */
+            k = j ? (j - 1) % 9 : 0;
+            buf[j] = (k == 3 || k == 4 || k == 7 || k == 8) && (r >> 8) % 4 ?
+                     0 : r;
+        }
+        LLVMFuzzerTestOneInput(buf, size);
+    }
+}
+
+/* Volatile sink keeps benchmarked calls from being optimised out */
+static volatile unsigned int sink;
+
+#define BENCH_LOOKUPS 10000000
+#define BENCH_SETS 200000
+
+/* Function measuring nanoseconds per call of lookup over values */
+#define BENCH_LOOKUP(name, lookup, type) \
+static double \
+name(const type *values, size_t count) \
+{ \
+    double start = tio_now(); \
+    size_t i; \
+\
+    for (i = 0; i < BENCH_LOOKUPS; i++) \
+        sink += lookup(values[i % count]); \
+\
+    return (tio_now() - start) / BENCH_LOOKUPS * 1e9; \
+}
+
+BENCH_LOOKUP(bench_map_n_to_bn, map_n_to_bn, unsigned int)
+BENCH_LOOKUP(bench_scan_n_to_bn, scan_n_to_bn, unsigned int)
+BENCH_LOOKUP(bench_map_bn_to_n, map_bn_to_n, tcflag_t)
+BENCH_LOOKUP(bench_scan_bn_to_n, scan_bn_to_n, tcflag_t)
+
+/* Gain of switch lookups over the table scan they replaced */
+static void
+bench_lookup(void)
+{
+    unsigned int rates[64];
+    tcflag_t bns[NSTANDARD];
+    size_t i, n;
+
+    n = lookup_rates(rates, 64);
+    for (i = 0; i < NSTANDARD; i++)
+        bns[i] = map_n_to_bn(standard_rates[i]);
+
+    printf("bench: rate to Bnnn %.2f ns per lookup, table scan %.2f ns\n",
+           bench_map_n_to_bn(rates, n), bench_scan_n_to_bn(rates, n));
+    printf("bench: Bnnn to rate %.2f ns per lookup, table scan %.2f ns\n",
+           bench_map_bn_to_n(bns, NSTANDARD),
+           bench_scan_bn_to_n(bns, NSTANDARD));
+}
+
+static void
+bench_set(void)
+{
+    const struct sim_config cfg = { 1843200, SIM_ROUND_EXACT, 0 };
+    struct baudrate_session *session;
+    unsigned int output, input;
+    int fd, presets[2];
+    double start, t;
+    size_t i;
+
+    sim_enable(&cfg);
+    fd = sim_open();
+    if (fd < 0) {
+        perror("sim_open");
+        return;
+    }
+
+    start = tio_now();
+    for (i = 0; i < BENCH_SETS; i++)
+        baudrate_change(fd, i & 1 ? 250000 : 9600, i & 1 ? 250000 : 9600,
+                        &output, &input);
+    t = tio_now() - start;
+    printf("bench: baudrate_change %.0f ns per set\n", t / BENCH_SETS * 1e9);
+
+    if (baudrate_session_new(fd, &session) == 0) {
+        presets[0] = baudrate_session_add(session, 9600, 9600);
+        presets[1] = baudrate_session_add(session, 250000, 250000);
+        start = tio_now();
+        for (i = 0; i < BENCH_SETS; i++)
+            baudrate_session_switch(session, presets[i & 1], BAUDRATE_NOW);
+        t = tio_now() - start;
+        printf("bench: baudrate_session_switch %.0f ns per set\n",
+               t / BENCH_SETS * 1e9);
+        baudrate_session_free(session);
+    }
+
+    close(fd);
+    baudrate_set_backend(NULL, NULL);
+}
+
+int
+main(void)
+{
+    check_map();
+    check_divisors();
+    check_spd();
+    check_sim();
+    check_scan();
+    check_fuzz();
+
+    if (failures) {
+        fprintf(stderr, "%lu checks failed\n", failures);
+        return EXIT_FAILURE;
+    }
+    printf("all checks passed\n");
+
+    bench_lookup();
+    bench_set();
+    return EXIT_SUCCESS;
+}
+#endif
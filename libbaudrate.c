@@ -0,0 +1,1504 @@
+/* SPDX-FileCopyrightText: 2021 Pali Rohár <pali@kernel.org> */
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+#define _POSIX_C_SOURCE 200809L /* for O_CLOEXEC */
+#define _DEFAULT_SOURCE /* for major(), minor() */
+
+#include <errno.h>
+#include <limits.h> /* for UINT_MAX */
+#include <stddef.h> /* for NULL, size_t */
+#include <stdio.h> /* for snprintf() */
+#include <stdlib.h> /* for atoi(), malloc() */
+#include <time.h> /* for clock_gettime() */
+
+#include <fcntl.h> /* for open() */
+#include <unistd.h> /* for read(), write(), close() */
+#include <sys/ioctl.h> /* for ioctl() */
+#include <sys/stat.h> /* for fstat() */
+#include <sys/sysmacros.h> /* for major(), minor() */
+
+#include <asm/ioctls.h> /* for TCGETS, TCSETS, TCGETS2, TCSETS2, TIOCGSERIAL, TIOCSSERIAL, TIOCGRS485, TIOCGICOUNT */
+#include <asm/termbits.h> /* for BOTHER, Bnnn, struct termios, struct termios2 */
+#include <linux/serial.h> /* for ASYNC_SPD_*, struct serial_struct, struct serial_rs485, struct serial_icounter_struct */
+#include <linux/serial_core.h> /* for PORT_* of 8250 class UARTs */
+
+#include "baudrate.h"
+#include "rates.h"
+
+/* Callback installed by baudrate_set_trace() */
+static baudrate_trace_fn trace_fn;
+static void *trace_ctx;
+
+static baudrate_ioctl_fn backend_fn;
+static void *backend_ctx;
+
+static int
+backend_ioctl(int fd, unsigned long request, void *arg)
+{
+    if (backend_fn)
+        return backend_fn(backend_ctx, fd, request, arg);
+
+    return ioctl(fd, request, arg);
+}
+
+/* ioctl() reporting its duration to trace callback */
+static int
+traced_ioctl(int fd, int op, unsigned long request, void *arg)
+{
+    struct timespec start, end;
+    int rc, err;
+
+    if (!trace_fn)
+        return backend_ioctl(fd, request, arg);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    rc = backend_ioctl(fd, request, arg);
+    err = errno;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    trace_fn(trace_ctx, fd, op, (end.tv_sec - start.tv_sec) +
+             (end.tv_nsec - start.tv_nsec) / 1e9, rc);
+    errno = err;
+    return rc;
+}
+
+/* Lazily fetched serial_struct, TIOCGSERIAL is issued at most once */
+struct serial_cache {
+    int state; /* 0 - not fetched, 1 - valid, -1 - TIOCGSERIAL failed */
+    int err; /* errno of failed TIOCGSERIAL */
+    struct serial_struct ser;
+};
+
+/* Return cached serial_struct, or NULL with errno of TIOCGSERIAL also when
+   its failure is cached */
+static const struct serial_struct *
+get_serial(int fd, struct serial_cache *cache)
+{
+    if (!cache->state) {
+        if (traced_ioctl(fd, BAUDRATE_TRACE_TIOCGSERIAL, TIOCGSERIAL,
+                         &cache->ser)) {
+            cache->state = -1;
+            cache->err = errno;
+        } else {
+            cache->state = 1;
+        }
+    }
+
+    if (cache->state < 0) {
+        errno = cache->err;
+        return NULL;
+    }
+    return &cache->ser;
+}
+
+/* Type of tio structure depends on supported ioctl */
+#ifdef TCGETS2
+typedef struct termios2 tio_t;
+#else
+typedef struct termios tio_t;
+#endif
+
+/* Get the current serial port settings via supported ioctl */
+static int
+get_tio(int fd, tio_t *tio)
+{
+#ifdef TCGETS2
+    return traced_ioctl(fd, BAUDRATE_TRACE_TCGETS, TCGETS2, tio);
+#else
+    return traced_ioctl(fd, BAUDRATE_TRACE_TCGETS, TCGETS, tio);
+#endif
+}
+
+/* Set new serial port settings via supported ioctl, when selects how
+   pending data are handled */
+static int
+set_tio(int fd, int when, const tio_t *tio)
+{
+    void *arg = (void *)tio; /* ioctl() argument is not const */
+
+    switch (when) {
+#ifdef TCSETS2
+    case BAUDRATE_DRAIN:
+        return traced_ioctl(fd, BAUDRATE_TRACE_TCSETS, TCSETSW2, arg);
+    case BAUDRATE_FLUSH:
+        return traced_ioctl(fd, BAUDRATE_TRACE_TCSETS, TCSETSF2, arg);
+    default:
+        return traced_ioctl(fd, BAUDRATE_TRACE_TCSETS, TCSETS2, arg);
+#else
+    case BAUDRATE_DRAIN:
+        return traced_ioctl(fd, BAUDRATE_TRACE_TCSETS, TCSETSW, arg);
+    case BAUDRATE_FLUSH:
+        return traced_ioctl(fd, BAUDRATE_TRACE_TCSETS, TCSETSF, arg);
+    default:
+        return traced_ioctl(fd, BAUDRATE_TRACE_TCSETS, TCSETS, arg);
+#endif
+    }
+}
+
+static void
+get_rates(const tio_t *tio, int fd, struct serial_cache *cache,
+          unsigned int *output, unsigned int *input)
+{
+    unsigned int n;
+    tcflag_t bn;
+
+    /* Field c_ospeed is always filled by kernel with exact baud rate value,
+       kernel tries to round c_ospeed to some Bnnn constant in 2% tolerance,
+       if it is not possible then BOTHER is set */
+    bn = tio->c_cflag & CBAUD;
+#ifdef BOTHER
+    n = tio->c_ospeed;
+#else
+    n = map_bn_to_n(bn);
+#endif
+    /* B38400 can be aliased by ASYNC_SPD_MASK flag */
+    if (bn == B38400)
+        n = get_spd_B38400_alias(get_serial(fd, cache));
+    *output = n;
+
+#ifdef IBSHIFT
+    bn = (tio->c_cflag >> IBSHIFT) & CBAUD;
+    /* B0 indicates that input baud rate is set to the output baud rate */
+    if (bn == B0)
+#endif
+        bn = tio->c_cflag & CBAUD;
+#ifdef BOTHER
+    n = tio->c_ispeed;
+#else
+    n = map_bn_to_n(bn);
+#endif
+    /* B38400 can be aliased by ASYNC_SPD_MASK flag */
+    if (bn == B38400)
+        n = get_spd_B38400_alias(get_serial(fd, cache));
+    *input = n;
+}
+
+/* Number of bits on the line for one character */
+static unsigned int
+get_char_bits(tcflag_t cflag)
+{
+    unsigned int bits;
+
+    switch (cflag & CSIZE) {
+    case CS5:
+        bits = 5;
+        break;
+    case CS6:
+        bits = 6;
+        break;
+    case CS7:
+        bits = 7;
+        break;
+    default:
+        bits = 8;
+        break;
+    }
+
+    /* Start bit, optional parity bit and one or two stop bits */
+    return 1 + bits + ((cflag & PARENB) ? 1 : 0) + ((cflag & CSTOPB) ? 2 : 1);
+}
+
+/* Check if port is already configured to the requested baud rates */
+static int
+is_configured(const tio_t *tio, unsigned int cur_output, unsigned int cur_input,
+              unsigned int output, unsigned int input)
+{
+    tcflag_t bn;
+
+    bn = map_n_to_bn(output);
+    if (output != 0 && bn == B0) {
+#ifdef BOTHER
+        bn = BOTHER;
+#else
+        bn = B38400;
+#endif
+    }
+
+    /* Non-Bnnn constant is replaced by Bnnn when possible */
+    if ((tio->c_cflag & CBAUD) != bn)
+        return 0;
+
+    return cur_output == output && cur_input == input;
+}
+
+int
+baudrate_get(int fd, unsigned int *output, unsigned int *input)
+{
+    struct serial_cache cache = { 0 };
+    tio_t tio;
+    int rc;
+
+    rc = get_tio(fd, &tio);
+    if (rc)
+        return -1;
+
+    get_rates(&tio, fd, &cache, output, input);
+    return 0;
+}
+
+int
+baudrate_get_info(int fd, struct baudrate_info *info)
+{
+    struct serial_cache cache = { 0 };
+    const struct serial_struct *ser;
+    tio_t tio;
+    int rc;
+
+    rc = get_tio(fd, &tio);
+    if (rc)
+        return -1;
+
+    get_rates(&tio, fd, &cache, &info->output, &info->input);
+
+    info->cbaud = tio.c_cflag & CBAUD;
+#ifdef IBSHIFT
+    info->cibaud = (tio.c_cflag >> IBSHIFT) & CBAUD;
+#else
+    info->cibaud = B0;
+#endif
+#ifdef BOTHER
+    info->bother = info->cbaud == BOTHER || info->cibaud == BOTHER;
+#else
+    info->bother = 0;
+#endif
+    info->char_bits = get_char_bits(tio.c_cflag);
+
+    ser = get_serial(fd, &cache);
+    info->serial = ser != NULL;
+    info->spd_flags = ser ? ser->flags & ASYNC_SPD_MASK : 0;
+    info->custom_divisor = ser ? ser->custom_divisor : 0;
+    info->baud_base = ser ? ser->baud_base : 0;
+    return 0;
+}
+
+/* Time of count bits in ns, count is in halves of bit */
+static unsigned long long
+half_bits_ns(unsigned int rate, unsigned long long halves)
+{
+    return (halves * 1000000000ULL + 2ULL * rate - 1) / (2ULL * rate);
+}
+
+int
+baudrate_timing(unsigned int rate, unsigned int char_bits,
+                struct baudrate_timing *timing)
+{
+    unsigned long long vtime;
+
+    if (rate == 0 || rate == BAUDRATE_UNKNOWN || char_bits == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    timing->rate = rate;
+    timing->char_bits = char_bits;
+    timing->bit_ns = half_bits_ns(rate, 2);
+    timing->char_ns = half_bits_ns(rate, 2ULL * char_bits);
+    timing->gap15_ns = half_bits_ns(rate, 3ULL * char_bits);
+    timing->gap35_ns = half_bits_ns(rate, 7ULL * char_bits);
+
+    /* VTIME is in deciseconds and zero would disable the timer */
+    vtime = (timing->gap15_ns + 100000000ULL - 1) / 100000000ULL;
+    timing->vtime = vtime < 1 ? 1 : vtime > 255 ? 255 : vtime;
+    return 0;
+}
+
+int
+baudrate_get_timing(int fd, struct baudrate_timing *timing)
+{
+    struct serial_cache cache = { 0 };
+    unsigned int output, input;
+    tio_t tio;
+    int rc;
+
+    rc = get_tio(fd, &tio);
+    if (rc)
+        return -1;
+
+    get_rates(&tio, fd, &cache, &output, &input);
+    return baudrate_timing(output, get_char_bits(tio.c_cflag), timing);
+}
+
+/* Path of sysfs attribute of tty device opened as fd */
+static int
+sysfs_path(int fd, const char *attr, char *path, size_t size)
+{
+    struct stat st;
+
+    if (fstat(fd, &st))
+        return -1;
+    if (!S_ISCHR(st.st_mode)) {
+        errno = ENOTTY;
+        return -1;
+    }
+
+    snprintf(path, size, "/sys/dev/char/%u:%u/%s",
+             major(st.st_rdev), minor(st.st_rdev), attr);
+    return 0;
+}
+
+/* Read integer sysfs attribute, value is -1 when attribute does not exist */
+static int
+get_sysfs_attr(int fd, const char *attr, int *value)
+{
+    char path[128], buf[32];
+    ssize_t len;
+    int afd;
+
+    *value = -1;
+    if (sysfs_path(fd, attr, path, sizeof(path)))
+        return -1;
+
+    afd = open(path, O_RDONLY | O_CLOEXEC);
+    if (afd < 0)
+        return -1;
+    len = read(afd, buf, sizeof(buf) - 1);
+    close(afd);
+    if (len <= 0)
+        return -1;
+
+    buf[len] = '\0';
+    *value = atoi(buf);
+    return 0;
+}
+
+/* Write integer sysfs attribute when it differs, missing attribute means
+   that driver does not support it and is not an error; with verify set the
+   value is read back as driver may round it */
+static int
+set_sysfs_attr(int fd, const char *attr, int value, int verify)
+{
+    char path[128], buf[32];
+    int afd, cur, len;
+
+    if (get_sysfs_attr(fd, attr, &cur))
+        return errno == ENOENT ? 0 : -1;
+    if (cur == value)
+        return 0;
+
+    if (sysfs_path(fd, attr, path, sizeof(path)))
+        return -1;
+    afd = open(path, O_WRONLY | O_CLOEXEC);
+    if (afd < 0)
+        return -1;
+    len = snprintf(buf, sizeof(buf), "%d\n", value);
+    if (write(afd, buf, len) != len) {
+        close(afd);
+        return -1;
+    }
+    if (close(afd))
+        return -1;
+
+    if (verify && (get_sysfs_attr(fd, attr, &cur) || cur != value)) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Start modification of serial_struct, all changes are then written by
+   one TIOCSSERIAL call */
+static struct serial_struct *
+edit_serial(int fd, struct serial_cache *cache, struct serial_struct *ser,
+            int *dirty)
+{
+    if (!*dirty) {
+        if (!get_serial(fd, cache))
+            return NULL;
+        *ser = cache->ser;
+        *dirty = 1;
+    }
+
+    return ser;
+}
+
+void
+baudrate_opts_init(struct baudrate_opts *opts)
+{
+    opts->low_latency = -1;
+    opts->vmin = -1;
+    opts->vtime = -1;
+    opts->latency_timer = -1;
+    opts->rx_trigger = -1;
+    opts->rs485_delay = -1;
+}
+
+/* RTS delay in ms covering chars characters, rounded up as kernel has
+   only ms resolution */
+static unsigned int
+rs485_delay_ms(unsigned int rate, unsigned int char_bits, unsigned int chars)
+{
+    unsigned long long ms;
+
+    ms = ((unsigned long long)chars * char_bits * 1000 + rate - 1) / rate;
+    return ms > UINT_MAX ? UINT_MAX : ms;
+}
+
+/* Change computed by prepare() and written by commit() */
+struct baudrate_prepared {
+    int fd;
+    struct serial_cache cache;
+    tio_t tio;
+    int tio_dirty;
+    struct serial_struct ser;
+    int ser_dirty;
+    /* Snapshot restored by rollback() and what was already written */
+    tio_t saved_tio;
+    struct serial_struct saved_ser;
+    int tio_written;
+    int ser_written;
+    struct serial_rs485 rs485; /* read by prepare when rs485_delay is set */
+    struct serial_rs485 saved_rs485;
+    int rs485_written;
+    int have_opts;
+    struct baudrate_opts opts; /* low_latency -1 when not an UART */
+    unsigned int cur_output; /* rates before change */
+    unsigned int cur_input;
+    double set_seconds; /* duration of TCSETS2 issued by commit */
+};
+
+/* Compute new tio and serial_struct values from current prep->tio and
+   prep->cache, TIOCGSERIAL is issued only when cache is not filled yet */
+static int
+build(struct baudrate_prepared *prep, unsigned int output, unsigned int input,
+      const struct baudrate_opts *opts)
+{
+    struct serial_cache *cache = &prep->cache;
+    struct serial_struct *ser = &prep->ser;
+    tio_t *tio = &prep->tio;
+    const struct serial_struct *cur;
+    int fd = prep->fd;
+    unsigned int n;
+    tcflag_t bn;
+    int rc;
+
+    get_rates(tio, fd, cache, &prep->cur_output, &prep->cur_input);
+
+    /* Setting the same values would needlessly reprogram the UART */
+    if (!is_configured(tio, prep->cur_output, prep->cur_input, output, input)) {
+        prep->tio_dirty = 1;
+
+        /* Clear the current output baud rate and fill a new value */
+        n = output;
+        /* When possible prefer usage of Bnnn constant as glibc-based
+           applications are not able to parse BOTHER c_ospeed baud rate */
+        bn = map_n_to_bn(n);
+        if (n != 0 && bn == B0) {
+#ifdef BOTHER
+            bn = BOTHER;
+#else
+            if (!edit_serial(fd, cache, ser, &prep->ser_dirty)) {
+                errno = EINVAL; /* baud rate is unsupported */
+                return -1;
+            }
+            /* B38400 is aliased to different baud rate configured by
+               custom_divisor field when ASYNC_SPD_MASK flag is set to
+               ASYNC_SPD_CUST value via TIOCSSERIAL */
+            bn = B38400;
+            ser->flags &= ~ASYNC_SPD_MASK;
+            ser->flags |= ASYNC_SPD_CUST;
+            ser->custom_divisor = rate_divisor(ser->baud_base, n);
+            /* Zero divisor would silently mean 38400 */
+            if (!ser->custom_divisor) {
+                errno = EINVAL; /* baud rate is unsupported */
+                return -1;
+            }
+#endif
+        } else if (n == 38400) {
+            cur = get_serial(fd, cache);
+            if (cur && (cur->flags & ASYNC_SPD_MASK)) {
+                /* Clear ASYNC_SPD_MASK flag via TIOCSSERIAL
+                   as it aliases 38400 to some other baud rate */
+                edit_serial(fd, cache, ser, &prep->ser_dirty);
+                ser->flags &= ~ASYNC_SPD_MASK;
+                ser->custom_divisor = 0;
+            }
+        }
+        tio->c_cflag &= ~CBAUD;
+        tio->c_cflag |= bn;
+#ifdef BOTHER
+        tio->c_ospeed = n;
+#endif
+
+        /* When input baud rate is same as output just reuse it */
+        if (input != output) {
+            n = input;
+            bn = map_n_to_bn(n);
+            if (n != 0 && bn == B0) {
+#ifdef BOTHER
+                bn = BOTHER;
+#else
+                errno = EINVAL; /* input baud rate is unsupported */
+                return -1;
+#endif
+            }
+            if ((tio->c_cflag & CBAUD) != B0 && n == 0) {
+#ifdef BOTHER
+                bn = BOTHER;
+#else
+                errno = EINVAL; /* input baud rate cannot be zero */
+                return -1;
+#endif
+            }
+        }
+
+        /* Clear the current input baud rate and fill a new value */
+        if ((tio->c_cflag & CBAUD) != bn
+#ifdef BOTHER
+            || (bn == BOTHER && tio->c_ospeed != n)
+#endif
+           ) {
+#ifdef IBSHIFT
+            tio->c_cflag &= ~(CBAUD << IBSHIFT);
+            tio->c_cflag |= bn << IBSHIFT;
+#ifdef BOTHER
+            tio->c_ispeed = n;
+#endif
+#else
+            errno = EOPNOTSUPP; /* split baud rates are unsupported */
+            return -1;
+#endif
+        } else {
+#ifdef IBSHIFT
+            /* B0 sets the input baud rate to the output baud rate */
+            tio->c_cflag &= ~(CBAUD << IBSHIFT);
+            tio->c_cflag |= B0 << IBSHIFT;
+#ifdef BOTHER
+            tio->c_ispeed = 0;
+#endif
+#endif
+        }
+    }
+
+    if (!opts)
+        return 0;
+
+    /* Other settings are applied in the same TIOCSSERIAL and TCSETS2 */
+    if (opts->low_latency >= 0) {
+        cur = get_serial(fd, cache);
+        if (!cur && errno != ENOTTY && errno != EINVAL)
+            return -1;
+        if (!cur) {
+            prep->opts.low_latency = -1; /* not an UART, e.g. pty */
+        } else if (!(cur->flags & ASYNC_LOW_LATENCY) != !opts->low_latency) {
+            edit_serial(fd, cache, ser, &prep->ser_dirty);
+            if (opts->low_latency)
+                ser->flags |= ASYNC_LOW_LATENCY;
+            else
+                ser->flags &= ~ASYNC_LOW_LATENCY;
+        }
+    }
+    if (opts->vmin >= 0 && tio->c_cc[VMIN] != opts->vmin) {
+        tio->c_cc[VMIN] = opts->vmin;
+        prep->tio_dirty = 1;
+    }
+    if (opts->vtime >= 0 && tio->c_cc[VTIME] != opts->vtime) {
+        tio->c_cc[VTIME] = opts->vtime;
+        prep->tio_dirty = 1;
+    }
+    /* Delays depend on final baud rate, so they are computed by commit */
+    if (opts->rs485_delay >= 0) {
+        rc = traced_ioctl(fd, BAUDRATE_TRACE_TIOCGRS485, TIOCGRS485,
+                          &prep->rs485);
+        if (rc)
+            return -1;
+        prep->saved_rs485 = prep->rs485;
+    }
+
+    return 0;
+}
+
+/* Read current settings and compute new tio and serial_struct values,
+   nothing is written to the device yet */
+static int
+prepare(int fd, unsigned int output, unsigned int input,
+        const struct baudrate_opts *opts, struct baudrate_prepared *prep)
+{
+    tio_t *tio = &prep->tio;
+    int rc;
+
+    prep->fd = fd;
+    prep->cache.state = 0;
+    prep->cur_output = BAUDRATE_UNKNOWN;
+    prep->cur_input = BAUDRATE_UNKNOWN;
+    prep->tio_dirty = 0;
+    prep->ser_dirty = 0;
+    prep->tio_written = 0;
+    prep->ser_written = 0;
+    prep->rs485_written = 0;
+    prep->set_seconds = 0;
+    prep->have_opts = opts != NULL;
+    if (opts)
+        prep->opts = *opts;
+
+    rc = get_tio(fd, tio);
+    if (rc)
+        return -1;
+
+    prep->saved_tio = *tio;
+    return build(prep, output, input, opts);
+}
+
+/* Write snapshot taken before change back in reverse order */
+static int
+rollback(struct baudrate_prepared *prep)
+{
+    int rc = 0, err = errno;
+
+    if (prep->rs485_written) {
+        rc |= traced_ioctl(prep->fd, BAUDRATE_TRACE_TIOCSRS485, TIOCSRS485,
+                           &prep->saved_rs485);
+        prep->rs485_written = 0;
+    }
+    if (prep->tio_written) {
+        rc |= set_tio(prep->fd, BAUDRATE_NOW, &prep->saved_tio);
+        prep->tio_written = 0;
+    }
+    if (prep->ser_written) {
+        rc |= traced_ioctl(prep->fd, BAUDRATE_TRACE_TIOCSSERIAL, TIOCSSERIAL,
+                           &prep->saved_ser);
+        prep->ser_written = 0;
+    }
+
+    prep->cache.state = 0;
+    if (!rc)
+        errno = err;
+    return rc ? -1 : 0;
+}
+
+/* Write prepared change, when selects how pending data are handled */
+static int
+apply(struct baudrate_prepared *prep, int when,
+      unsigned int *cur_output, unsigned int *cur_input)
+{
+    const struct baudrate_opts *opts = &prep->opts;
+    const struct serial_struct *cur;
+    struct timespec start, end;
+    int fd = prep->fd;
+    tio_t *tio = &prep->tio;
+    tio_t want;
+    unsigned int ms;
+    int rc;
+
+    if (prep->ser_dirty) {
+        /* edit_serial() fetched the original into cache */
+        prep->saved_ser = prep->cache.ser;
+        rc = traced_ioctl(fd, BAUDRATE_TRACE_TIOCSSERIAL, TIOCSSERIAL,
+                          &prep->ser);
+        if (rc)
+            return -1;
+        prep->ser_written = 1;
+        prep->cache.state = 0; /* kernel may adjust written values */
+    }
+
+    if (prep->tio_dirty) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        rc = set_tio(fd, when, tio);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        prep->set_seconds = (end.tv_sec - start.tv_sec) +
+                            (end.tv_nsec - start.tv_nsec) / 1e9;
+        if (rc)
+            return -1;
+        prep->tio_written = 1;
+
+        /* And get new values which were really configured */
+        want = *tio;
+        rc = get_tio(fd, tio);
+        if (rc)
+            return -1;
+
+        /* Driver may round baud rate, but nothing else may change */
+        if ((tio->c_cflag & ~(CBAUD | CIBAUD)) !=
+            (want.c_cflag & ~(CBAUD | CIBAUD)) ||
+            tio->c_iflag != want.c_iflag || tio->c_oflag != want.c_oflag ||
+            tio->c_lflag != want.c_lflag) {
+            errno = EPROTO;
+            return -1;
+        }
+
+        get_rates(tio, fd, &prep->cache, cur_output, cur_input);
+    }
+
+    if (!prep->have_opts)
+        return 0;
+
+    /* Verify that driver accepted all other settings */
+    if ((opts->vmin >= 0 && tio->c_cc[VMIN] != opts->vmin) ||
+        (opts->vtime >= 0 && tio->c_cc[VTIME] != opts->vtime)) {
+        errno = EPROTO;
+        return -1;
+    }
+    if (opts->low_latency >= 0) {
+        cur = get_serial(fd, &prep->cache);
+        if (!cur || !(cur->flags & ASYNC_LOW_LATENCY) != !opts->low_latency) {
+            errno = EPROTO;
+            return -1;
+        }
+    }
+
+    /* Attributes not covered by ioctls are only in sysfs */
+    if (opts->latency_timer >= 0 &&
+        set_sysfs_attr(fd, "device/latency_timer", opts->latency_timer, 1))
+        return -1;
+    if (opts->rx_trigger >= 0 &&
+        set_sysfs_attr(fd, "rx_trig_bytes", opts->rx_trigger, 0))
+        return -1;
+
+    /* Turnaround delays in character times of the new line settings */
+    if (opts->rs485_delay >= 0 && *cur_output != 0 &&
+        *cur_output != BAUDRATE_UNKNOWN) {
+        ms = rs485_delay_ms(*cur_output, get_char_bits(tio->c_cflag),
+                            opts->rs485_delay);
+        if (prep->rs485.delay_rts_before_send != ms ||
+            prep->rs485.delay_rts_after_send != ms) {
+            prep->rs485.delay_rts_before_send = ms;
+            prep->rs485.delay_rts_after_send = ms;
+            rc = traced_ioctl(fd, BAUDRATE_TRACE_TIOCSRS485, TIOCSRS485,
+                              &prep->rs485);
+            if (rc)
+                return -1;
+            prep->rs485_written = 1;
+            /* Kernel clamps delays silently and returns them back */
+            if (prep->rs485.delay_rts_before_send != ms ||
+                prep->rs485.delay_rts_after_send != ms) {
+                errno = EPROTO;
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/* Apply change and restore snapshot when any part of it failed */
+static int
+commit(struct baudrate_prepared *prep, int when,
+       unsigned int *cur_output, unsigned int *cur_input)
+{
+    *cur_output = prep->cur_output;
+    *cur_input = prep->cur_input;
+
+    if (apply(prep, when, cur_output, cur_input) == 0)
+        return 0;
+
+    rollback(prep);
+    *cur_output = prep->cur_output;
+    *cur_input = prep->cur_input;
+    return -1;
+}
+
+int
+baudrate_change_opts(int fd, unsigned int output, unsigned int input,
+                     const struct baudrate_opts *opts,
+                     unsigned int *cur_output, unsigned int *cur_input)
+{
+    struct baudrate_prepared prep;
+
+    if (prepare(fd, output, input, opts, &prep)) {
+        /* Report current values, like when change was rejected */
+        *cur_output = prep.cur_output;
+        *cur_input = prep.cur_input;
+        return -1;
+    }
+
+    return commit(&prep, BAUDRATE_NOW, cur_output, cur_input);
+}
+
+int
+baudrate_prepare(int fd, unsigned int output, unsigned int input,
+                 const struct baudrate_opts *opts,
+                 struct baudrate_prepared **prep)
+{
+    int err;
+
+    *prep = malloc(sizeof(**prep));
+    if (!*prep)
+        return -1;
+
+    if (prepare(fd, output, input, opts, *prep)) {
+        err = errno;
+        free(*prep);
+        *prep = NULL;
+        errno = err;
+        return -1;
+    }
+
+    return 0;
+}
+
+int
+baudrate_commit(struct baudrate_prepared *prep, int when,
+                unsigned int *cur_output, unsigned int *cur_input)
+{
+    return commit(prep, when, cur_output, cur_input);
+}
+
+int
+baudrate_rollback(struct baudrate_prepared *prep)
+{
+    return rollback(prep);
+}
+
+double
+baudrate_commit_seconds(const struct baudrate_prepared *prep)
+{
+    return prep->set_seconds;
+}
+
+void
+baudrate_prepared_free(struct baudrate_prepared *prep)
+{
+    free(prep);
+}
+
+/* Complete image of settings for one pair of baud rates */
+struct session_preset {
+    unsigned int output; /* requested baud rates */
+    unsigned int input;
+    tio_t tio;
+    struct serial_struct ser;
+    int have_ser; /* ser has to be written when it differs from current */
+};
+
+struct baudrate_session {
+    int fd;
+    struct serial_cache cache; /* serial_struct read from device */
+    tio_t tio; /* settings read from device, presets are built from it */
+    struct serial_struct ser; /* last written or read serial_struct */
+    int have_ser;
+    struct session_preset *presets;
+    size_t count;
+    size_t alloc;
+};
+
+/* Compute preset from settings read by session, may issue TIOCGSERIAL */
+static int
+build_preset(struct baudrate_session *session, struct session_preset *preset)
+{
+    struct baudrate_prepared prep;
+
+    prep.fd = session->fd;
+    prep.cache = session->cache;
+    prep.tio = session->tio;
+    prep.tio_dirty = 0;
+    prep.ser_dirty = 0;
+    prep.have_opts = 0;
+    if (build(&prep, preset->output, preset->input, NULL))
+        return -1;
+
+    /* Device was not written yet, so serial_struct in cache is current */
+    session->cache = prep.cache;
+    if (!session->have_ser && session->cache.state == 1) {
+        session->ser = session->cache.ser;
+        session->have_ser = 1;
+    }
+
+    preset->tio = prep.tio;
+    preset->have_ser = prep.ser_dirty || session->cache.state == 1;
+    preset->ser = prep.ser_dirty ? prep.ser : session->cache.ser;
+    return 0;
+}
+
+int
+baudrate_session_new(int fd, struct baudrate_session **session)
+{
+    *session = calloc(1, sizeof(**session));
+    if (!*session)
+        return -1;
+
+    (*session)->fd = fd;
+    if (baudrate_session_refresh(*session)) {
+        free(*session);
+        *session = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+int
+baudrate_session_refresh(struct baudrate_session *session)
+{
+    size_t i;
+    int rc;
+
+    rc = get_tio(session->fd, &session->tio);
+    if (rc)
+        return -1;
+
+    session->cache.state = 0;
+    session->have_ser = 0;
+    for (i = 0; i < session->count; i++) {
+        if (build_preset(session, &session->presets[i]))
+            return -1;
+    }
+
+    return 0;
+}
+
+int
+baudrate_session_add(struct baudrate_session *session, unsigned int output,
+                     unsigned int input)
+{
+    struct session_preset *presets, *p;
+    size_t alloc;
+
+    if (session->count == (size_t)INT_MAX) {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    if (session->count == session->alloc) {
+        alloc = session->alloc ? session->alloc * 2 : 4;
+        presets = realloc(session->presets, alloc * sizeof(*presets));
+        if (!presets)
+            return -1;
+        session->presets = presets;
+        session->alloc = alloc;
+    }
+
+    p = &session->presets[session->count];
+    p->output = output;
+    p->input = input;
+    if (build_preset(session, p))
+        return -1;
+
+    return session->count++;
+}
+
+int
+baudrate_session_switch(struct baudrate_session *session, int preset,
+                        int when)
+{
+    struct session_preset *p;
+    int rc;
+
+    if (preset < 0 || (size_t)preset >= session->count) {
+        errno = EINVAL;
+        return -1;
+    }
+    p = &session->presets[preset];
+
+    /* Only custom rates without BOTHER and going back from them need it */
+    if (p->have_ser && session->have_ser &&
+        (p->ser.flags != session->ser.flags ||
+         p->ser.custom_divisor != session->ser.custom_divisor)) {
+        rc = traced_ioctl(session->fd, BAUDRATE_TRACE_TIOCSSERIAL,
+                          TIOCSSERIAL, &p->ser);
+        if (rc)
+            return -1;
+        session->ser = p->ser;
+    }
+
+    return set_tio(session->fd, when, &p->tio);
+}
+
+void
+baudrate_session_free(struct baudrate_session *session)
+{
+    if (!session)
+        return;
+
+    free(session->presets);
+    free(session);
+}
+
+int
+baudrate_change(int fd, unsigned int output, unsigned int input,
+                unsigned int *cur_output, unsigned int *cur_input)
+{
+    return baudrate_change_opts(fd, output, input, NULL,
+                                cur_output, cur_input);
+}
+
+int
+baudrate_get_opts(int fd, struct baudrate_opts *opts)
+{
+    struct serial_cache cache = { 0 };
+    const struct serial_struct *ser;
+    struct serial_rs485 rs485;
+    unsigned int output, input, bits;
+    tio_t tio;
+    int rc;
+
+    rc = get_tio(fd, &tio);
+    if (rc)
+        return -1;
+
+    baudrate_opts_init(opts);
+    get_rates(&tio, fd, &cache, &output, &input);
+    bits = get_char_bits(tio.c_cflag);
+    if (output != 0 && output != BAUDRATE_UNKNOWN &&
+        traced_ioctl(fd, BAUDRATE_TRACE_TIOCGRS485, TIOCGRS485, &rs485) == 0)
+        opts->rs485_delay = ((unsigned long long)rs485.delay_rts_before_send *
+                             output + bits * 500) / (bits * 1000);
+    opts->vmin = tio.c_cc[VMIN];
+    opts->vtime = tio.c_cc[VTIME];
+    ser = get_serial(fd, &cache);
+    if (ser)
+        opts->low_latency = (ser->flags & ASYNC_LOW_LATENCY) ? 1 : 0;
+    get_sysfs_attr(fd, "device/latency_timer", &opts->latency_timer);
+    get_sysfs_attr(fd, "rx_trig_bytes", &opts->rx_trigger);
+    return 0;
+}
+
+int
+baudrate_set(int fd, unsigned int output, unsigned int input)
+{
+    unsigned int cur_output, cur_input;
+
+    return baudrate_change(fd, output, input, &cur_output, &cur_input);
+}
+
+/* Only 8250 class UARTs program custom_divisor into 16-bit divisor latch
+   clocked by baud_base. Other drivers report in baud_base e.g. current
+   rate (cdc-acm) or use fractional divisors (ftdi_sio) */
+static int
+is_divisor_uart(const struct serial_struct *ser)
+{
+    return ser && ser->baud_base > 0 && ser->type >= PORT_8250 &&
+           ser->type <= PORT_16550A_FSL64 && ser->type != PORT_8250_CIR;
+}
+
+/* Rate produced by baud_base and the closest integer divisor */
+static unsigned int
+fit_divisor(unsigned int base, unsigned int n)
+{
+    unsigned int d, rate_lo, rate_hi;
+
+    d = base / n;
+    if (d == 0)
+        return base; /* requested baud rate is above baud_base */
+    if (d >= 0xffff)
+        return divisor_rate(base, 0xffff); /* divisor is 16-bit */
+
+    /* Baud rate is not linear in divisor, so compare both neighbours */
+    rate_lo = divisor_rate(base, d + 1);
+    rate_hi = divisor_rate(base, d);
+    return n - rate_lo < rate_hi - n ? rate_lo : rate_hi;
+}
+
+int
+baudrate_best_fit(int fd, unsigned int n, unsigned int *rate, long *ppm)
+{
+    struct serial_cache cache = { 0 };
+    const struct serial_struct *ser;
+#ifdef BOTHER
+    struct baudrate_prepared prep;
+    unsigned int cur_output, cur_input;
+    int rc;
+#endif
+
+    *rate = n;
+    *ppm = 0;
+    if (n == 0)
+        return 0;
+
+    ser = get_serial(fd, &cache);
+    if (is_divisor_uart(ser)) {
+        /* UART clock is known, compute achievable rate analytically */
+        *rate = fit_divisor(ser->baud_base, n);
+    } else {
+#ifdef BOTHER
+        /* Otherwise ask kernel which baud rate driver really configures
+           and restore previous settings */
+        if (prepare(fd, n, n, NULL, &prep))
+            return -1;
+        rc = commit(&prep, BAUDRATE_NOW, &cur_output, &cur_input);
+        if (rc || rollback(&prep))
+            return -1;
+        if (cur_output != BAUDRATE_UNKNOWN && cur_output != 0)
+            *rate = cur_output;
+#endif
+    }
+
+    *ppm = ((long long)*rate - n) * 1000000 / n;
+    return 0;
+}
+
+/* Try to set rates, return 1 when driver accepted them and set exact when
+   it used exactly them */
+static int
+probe_rates(int fd, unsigned int output, unsigned int input, int *exact)
+{
+    unsigned int cur_output, cur_input;
+
+    *exact = 0;
+    if (baudrate_change(fd, output, input, &cur_output, &cur_input))
+        return errno == EINVAL || errno == EOPNOTSUPP ? 0 : -1;
+
+    *exact = cur_output == output && cur_input == input;
+    return 1;
+}
+
+int
+baudrate_probe(int fd, struct baudrate_caps *caps)
+{
+    struct serial_cache cache = { 0 };
+    const struct serial_struct *ser;
+    struct serial_struct saved_ser;
+    size_t i, n = sizeof(standard_rates)/sizeof(standard_rates[0]);
+    int rc, ok, exact, err, have_ser = 0;
+    tio_t saved;
+
+    rc = get_tio(fd, &saved);
+    if (rc)
+        return -1;
+
+    caps->standard = 0;
+    caps->standard_exact = 0;
+    caps->bother = BAUDRATE_CAP_NO;
+    caps->split = 0;
+    caps->baud_base = 0;
+    caps->min_divisor_rate = 0;
+
+    ser = get_serial(fd, &cache);
+    if (ser) {
+        saved_ser = *ser;
+        have_ser = 1;
+        if (is_divisor_uart(ser)) {
+            caps->baud_base = ser->baud_base;
+            /* custom_divisor is programmed into 16-bit divisor latch */
+            caps->min_divisor_rate =
+                ((unsigned long long)ser->baud_base + 0xfffe) / 0xffff;
+        }
+    }
+
+    rc = 0;
+    for (i = 0; i < n && i < 64; i++) {
+        if (standard_rates[i] == 0)
+            continue;
+        ok = probe_rates(fd, standard_rates[i], standard_rates[i], &exact);
+        if (ok < 0)
+            goto restore;
+        if (ok)
+            caps->standard |= 1ULL << i;
+        if (ok && exact)
+            caps->standard_exact |= 1ULL << i;
+    }
+
+    /* Rate of DMX512 which has no Bnnn constant */
+    ok = probe_rates(fd, 250000, 250000, &exact);
+    if (ok < 0)
+        goto restore;
+    if (ok)
+        caps->bother = exact ? BAUDRATE_CAP_EXACT : BAUDRATE_CAP_ROUNDED;
+
+    ok = probe_rates(fd, 9600, 4800, &exact);
+    if (ok < 0)
+        goto restore;
+    caps->split = ok;
+
+    rc = 1;
+
+restore:
+    err = errno;
+    /* Probing non-BOTHER rates may have modified speed flags and
+       custom_divisor, only serial_struct which was read is written back
+       and only when it differs now */
+    if (have_ser) {
+        cache.state = 0;
+        ser = get_serial(fd, &cache);
+        if (!ser || ser->flags != saved_ser.flags ||
+            ser->custom_divisor != saved_ser.custom_divisor)
+            traced_ioctl(fd, BAUDRATE_TRACE_TIOCSSERIAL, TIOCSSERIAL,
+                         &saved_ser);
+    }
+    set_tio(fd, BAUDRATE_NOW, &saved);
+    errno = err;
+    return rc ? 0 : -1;
+}
+
+/* Rate which driver configures when n is requested. Refused rates below
+   anchor, which driver supports, are reported as 0 and above it as
+   UINT_MAX, so the whole mapping is monotonic */
+static int
+rounded_rate(int fd, unsigned int n, unsigned int anchor, unsigned int *rate)
+{
+    unsigned int cur_output, cur_input;
+
+    if (baudrate_change(fd, n, n, &cur_output, &cur_input)) {
+        if (errno != EINVAL)
+            return -1;
+        cur_output = 0;
+    }
+
+    if (cur_output == 0 || cur_output == BAUDRATE_UNKNOWN)
+        cur_output = n < anchor ? 0 : UINT_MAX;
+    *rate = cur_output;
+    return 0;
+}
+
+/* Append rate to list, return 1 when list is full */
+static int
+add_rate(unsigned int *rates, size_t size, size_t *count, unsigned int rate)
+{
+    if (*count == size)
+        return 1;
+    rates[(*count)++] = rate;
+    return 0;
+}
+
+/* Exact rates of UART clock divided by 16-bit divisor */
+static int
+list_divisor_rates(unsigned int base, unsigned int min, unsigned int max,
+                   unsigned int *rates, size_t size, size_t *count)
+{
+    unsigned long long last;
+    unsigned int d, first;
+
+    if (min == 0)
+        min = 1;
+    if (max < min)
+        return 0;
+
+    first = base / min;
+    if (first > 0xffff)
+        first = 0xffff;
+    last = ((unsigned long long)base + max - 1) / max;
+    if (last < 1)
+        last = 1;
+
+    /* Decreasing divisor gives increasing rates */
+    for (d = first; d >= last && d > 0; d--) {
+        if (base % d == 0 && add_rate(rates, size, count, base / d))
+            return 1;
+    }
+
+    return 0;
+}
+
+/* Find rates for which driver keeps requested value. Driver maps requested
+   rate by monotonic step function, so the next step is found by galloping
+   bisection and only every distinct configured rate has to be checked */
+static int
+list_probed_rates(int fd, unsigned int min, unsigned int max,
+                  unsigned int *rates, size_t size, size_t *count)
+{
+    static const unsigned int anchors[] = { 9600, 115200, 1200, 1000000 };
+    unsigned int lo = min, hi, mid, cur, r, exact, anchor, step;
+    size_t i;
+
+    /* Some rate has to be accepted to tell where refused rates are */
+    for (i = 0; i < sizeof(anchors)/sizeof(anchors[0]); i++) {
+        if (rounded_rate(fd, anchors[i], 0, &anchor))
+            return -1;
+        if (anchor != UINT_MAX)
+            break;
+    }
+    if (i == sizeof(anchors)/sizeof(anchors[0]))
+        return 0;
+    anchor = anchors[i];
+
+    if (rounded_rate(fd, lo, anchor, &cur))
+        return -1;
+
+    for (;;) {
+        /* Rate configured for lo is exact when driver keeps it too */
+        if (cur >= lo && cur <= max) {
+            if (cur == lo) {
+                exact = cur;
+            } else if (rounded_rate(fd, cur, anchor, &exact)) {
+                return -1;
+            }
+            if (exact == cur && (*count == 0 || rates[*count-1] != cur) &&
+                add_rate(rates, size, count, cur))
+                return 1;
+        }
+
+        /* Gallop to the first rate which is rounded differently and then
+           bisect, cost grows with log of step and not of whole range */
+        if (lo == max)
+            return 0;
+        step = 1;
+        for (;;) {
+            hi = max - lo > step ? lo + step : max;
+            if (rounded_rate(fd, hi, anchor, &r))
+                return -1;
+            if (r != cur)
+                break;
+            if (hi == max)
+                return 0;
+            lo = hi;
+            step *= 2;
+        }
+        while (hi - lo > 1) {
+            mid = lo + (hi - lo) / 2;
+            if (rounded_rate(fd, mid, anchor, &r))
+                return -1;
+            if (r == cur)
+                lo = mid;
+            else
+                hi = mid;
+        }
+        lo = hi;
+        if (rounded_rate(fd, lo, anchor, &cur))
+            return -1;
+    }
+}
+
+int
+baudrate_list_rates(int fd, unsigned int min, unsigned int max,
+                    unsigned int *rates, size_t size, size_t *count)
+{
+    struct serial_cache cache = { 0 };
+    const struct serial_struct *ser;
+    int rc, err;
+    tio_t saved;
+
+    *count = 0;
+    if (min == 0)
+        min = 1;
+    if (min > max) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* UART clock is known, no need to touch the port */
+    ser = get_serial(fd, &cache);
+    if (is_divisor_uart(ser))
+        return list_divisor_rates(ser->baud_base, min, max, rates, size, count);
+
+    rc = get_tio(fd, &saved);
+    if (rc)
+        return -1;
+
+    rc = list_probed_rates(fd, min, max, rates, size, count);
+
+    err = errno;
+    set_tio(fd, BAUDRATE_NOW, &saved);
+    errno = err;
+    return rc;
+}
+
+int
+baudrate_caps_supported(const struct baudrate_caps *caps, unsigned int output,
+                        unsigned int input)
+{
+    size_t i, n = sizeof(standard_rates)/sizeof(standard_rates[0]);
+    unsigned int rates[2] = { output, input };
+    int j, found;
+
+    if (output != input && !caps->split) {
+        errno = EOPNOTSUPP; /* split baud rates are unsupported */
+        return 0;
+    }
+
+    for (j = 0; j < 2; j++) {
+        if (rates[j] == 0)
+            continue;
+        found = 0;
+        for (i = 0; i < n && i < 64; i++) {
+            if (standard_rates[i] == rates[j]) {
+                found = 1;
+                break;
+            }
+        }
+        if (found ? !(caps->standard & (1ULL << i)) :
+            caps->bother == BAUDRATE_CAP_NO) {
+            errno = EINVAL; /* baud rate is unsupported */
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+int
+baudrate_get_termios(int fd, void *tio)
+{
+    return get_tio(fd, tio);
+}
+
+int
+baudrate_set_termios(int fd, int when, const void *tio)
+{
+    return set_tio(fd, when, tio);
+}
+
+int
+baudrate_flush(int fd, int queue)
+{
+    return backend_ioctl(fd, TCFLSH, (void *)(unsigned long)queue);
+}
+
+int
+baudrate_get_icount(int fd, struct serial_icounter_struct *icount)
+{
+    return backend_ioctl(fd, TIOCGICOUNT, icount);
+}
+
+int
+baudrate_get_low_latency(int fd, int *enabled)
+{
+    struct serial_cache cache = { 0 };
+    const struct serial_struct *ser;
+
+    ser = get_serial(fd, &cache);
+    if (!ser)
+        return -1;
+
+    *enabled = (ser->flags & ASYNC_LOW_LATENCY) ? 1 : 0;
+    return 0;
+}
+
+int
+baudrate_set_low_latency(int fd, int enabled)
+{
+    struct serial_cache cache = { 0 };
+    struct serial_struct ser;
+
+    if (!get_serial(fd, &cache))
+        return -1;
+
+    /* Do not reprogram port when flag already has requested value */
+    if (!(cache.ser.flags & ASYNC_LOW_LATENCY) == !enabled)
+        return 0;
+
+    ser = cache.ser;
+    if (enabled)
+        ser.flags |= ASYNC_LOW_LATENCY;
+    else
+        ser.flags &= ~ASYNC_LOW_LATENCY;
+    return traced_ioctl(fd, BAUDRATE_TRACE_TIOCSSERIAL, TIOCSSERIAL, &ser);
+}
+
+void
+baudrate_set_trace(baudrate_trace_fn fn, void *ctx)
+{
+    trace_fn = fn;
+    trace_ctx = ctx;
+}
+
+void
+baudrate_set_backend(baudrate_ioctl_fn fn, void *ctx)
+{
+    backend_fn = fn;
+    backend_ctx = ctx;
+}
+
+const char *
+baudrate_trace_name(int op)
+{
+    switch (op) {
+#ifdef TCGETS2
+    case BAUDRATE_TRACE_TCGETS: return "TCGETS2";
+    case BAUDRATE_TRACE_TCSETS: return "TCSETS2";
+#else
+    case BAUDRATE_TRACE_TCGETS: return "TCGETS";
+    case BAUDRATE_TRACE_TCSETS: return "TCSETS";
+#endif
+    case BAUDRATE_TRACE_TIOCGSERIAL: return "TIOCGSERIAL";
+    case BAUDRATE_TRACE_TIOCSSERIAL: return "TIOCSSERIAL";
+    case BAUDRATE_TRACE_TIOCGRS485: return "TIOCGRS485";
+    case BAUDRATE_TRACE_TIOCSRS485: return "TIOCSRS485";
+    default: return "unknown";
+    }
+}
+
+size_t
+baudrate_list_standard(const unsigned int **rates)
+{
+    *rates = standard_rates;
+    return sizeof(standard_rates)/sizeof(standard_rates[0]);
+}
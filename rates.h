@@ -0,0 +1,114 @@
+/* SPDX-FileCopyrightText: 2021 Pali Rohár <pali@kernel.org> */
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+#ifndef RATES_H
+#define RATES_H
+
+/* Private to libbaudrate.c, simulated driver and tests, not installed */
+
+#include <limits.h> /* for INT_MAX */
+
+#include <asm/termbits.h> /* for Bnnn, tcflag_t */
+#include <linux/serial.h> /* for ASYNC_SPD_*, struct serial_struct */
+
+#include "baudrate.h"
+
+/* All supported Bnnn constants, expanded into switch statements below so
+   compiler can generate jump tables or balanced compare trees for both
+   lookup directions instead of scanning a table */
+#define MAP(B) \
+    B(0) B(50) B(75) B(110) B(134) B(150) B(200) B(300) B(600) \
+    B(1200) B(1800) B(2400) B(4800) B(9600) B(19200) B(38400) \
+    B(57600) B(115200) B(230400) B(460800) B(500000) B(576000) \
+    B(921600) B(1000000) B(1152000) B(1500000) B(2000000) \
+    MAP_ARCH(B)
+#ifdef B2500000
+/* non-SPARC architectures support these Bnnn constants */
+#define MAP_ARCH(B) B(2500000) B(3000000) B(3500000) B(4000000)
+#else
+/* SPARC architecture supports these Bnnn constants */
+#define MAP_ARCH(B) B(76800) B(153600) B(307200) B(614400)
+#endif
+
+static const unsigned int standard_rates[] = {
+#define B(n) n,
+    MAP(B)
+#undef B
+};
+
+/* Bnnn constant of rate n, B0 when there is none */
+static inline tcflag_t
+map_n_to_bn(unsigned int n)
+{
+#define B(n) case n: return B##n;
+    switch (n) {
+    MAP(B)
+    default:
+        return B0;
+    }
+#undef B
+}
+
+/* Rate of Bnnn constant bn, BAUDRATE_UNKNOWN for invalid bn */
+static inline unsigned int
+map_bn_to_n(tcflag_t bn)
+{
+#define B(n) case B##n: return n;
+    switch (bn) {
+    MAP(B)
+    default:
+        return BAUDRATE_UNKNOWN;
+    }
+#undef B
+}
+
+/* Rate produced by UART clock base and divisor d, rounded to nearest */
+static inline unsigned int
+divisor_rate(unsigned int base, unsigned int d)
+{
+    return ((unsigned long long)base + d/2) / d;
+}
+
+/* Closest custom_divisor for rate n, 0 when base cannot produce it */
+static inline int
+rate_divisor(int base, unsigned int n)
+{
+    unsigned long long d;
+
+    if (base <= 0 || n == 0)
+        return 0;
+
+    d = ((unsigned long long)base + n/2) / n;
+    return d > INT_MAX ? 0 : d;
+}
+
+/* Rate which B38400 means with ASYNC_SPD_* flags of ser, ser is NULL
+   without TIOCGSERIAL */
+static inline unsigned int
+get_spd_B38400_alias(const struct serial_struct *ser)
+{
+    if (!ser)
+        return 38400; /* ASYNC_SPD_MASK is unsupported */
+
+    if (!(ser->flags & ASYNC_SPD_MASK))
+        return 38400; /* ASYNC_SPD_MASK is not set */
+
+    if ((ser->flags & ASYNC_SPD_MASK) == ASYNC_SPD_CUST && !ser->custom_divisor)
+        return 38400; /* ASYNC_SPD_CUST is not active */
+
+    if ((ser->flags & ASYNC_SPD_MASK) == ASYNC_SPD_HI)
+        return 56000;
+    else if ((ser->flags & ASYNC_SPD_MASK) == ASYNC_SPD_VHI)
+        return 115200;
+    else if ((ser->flags & ASYNC_SPD_MASK) == ASYNC_SPD_SHI)
+        return 230400;
+    else if ((ser->flags & ASYNC_SPD_MASK) == ASYNC_SPD_WARP)
+        return 460800;
+    else if ((ser->flags & ASYNC_SPD_MASK) == ASYNC_SPD_CUST &&
+             ser->baud_base > 0 && ser->custom_divisor > 0)
+        return divisor_rate(ser->baud_base, ser->custom_divisor);
+    else
+        return BAUDRATE_UNKNOWN;
+}
+
+#endif
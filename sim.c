@@ -0,0 +1,364 @@
+/* SPDX-FileCopyrightText: 2021 Pali Rohár <pali@kernel.org> */
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+#define _POSIX_C_SOURCE 200809L /* for nanosleep() */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h> /* for open() */
+#include <pthread.h> /* for pthread_mutex_*() */
+#include <time.h> /* for nanosleep() */
+#include <unistd.h> /* for close() */
+
+#include <asm/ioctls.h> /* for TCGETS2, TCSETS2, TCFLSH, TIOCGSERIAL, TIOCSSERIAL, TIOCGRS485, TIOCGICOUNT */
+#include <asm/termbits.h> /* for BOTHER, IBSHIFT, Bnnn */
+#include <linux/serial.h> /* for ASYNC_SPD_*, struct serial_struct, struct serial_rs485, struct serial_icounter_struct */
+
+#include "baudrate.h"
+#include "rates.h"
+#include "sim.h"
+#include "tio.h"
+
+/* Kernel limit of delay_rts_before_send and delay_rts_after_send */
+#define SIM_MAX_RTS_DELAY 100
+
+struct sim_port {
+    int used;
+    tio_t tio;
+    struct serial_struct ser;
+    struct serial_rs485 rs485;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct sim_config config;
+static struct sim_port *ports; /* indexed by fd */
+static size_t nports;
+
+#if defined(TCGETS2) && defined(BOTHER)
+/* Baud rate which simulated driver uses for requested n */
+static unsigned int
+round_rate(unsigned int n)
+{
+    unsigned int best, diff;
+    int d;
+    size_t i;
+
+    if (n == 0)
+        return 0;
+
+    switch (config.round) {
+    case SIM_ROUND_DIVISOR:
+        d = rate_divisor(config.baud_base, n);
+        if (d < 1)
+            d = 1;
+        if (d > 0xffff)
+            d = 0xffff;
+        return divisor_rate(config.baud_base, d);
+    case SIM_ROUND_STANDARD:
+        best = standard_rates[1];
+        for (i = 1; i < sizeof(standard_rates)/sizeof(standard_rates[0]); i++) {
+            diff = standard_rates[i] > n ? standard_rates[i] - n : n - standard_rates[i];
+            if (diff < (best > n ? best - n : n - best))
+                best = standard_rates[i];
+        }
+        return best;
+    default:
+        return n;
+    }
+}
+
+/* Requested rate of CBAUD bits at shift, BAUDRATE_UNKNOWN when invalid */
+static unsigned int
+decode_rate(const tio_t *tio, unsigned int shift, unsigned int speed)
+{
+    tcflag_t bn = (tio->c_cflag >> shift) & CBAUD;
+
+    return bn == BOTHER ? speed : map_bn_to_n(bn);
+}
+
+/* Store rate as Bnnn constant when it has one, like kernel does */
+static void
+encode_rate(tio_t *tio, unsigned int shift, unsigned int *speed,
+            unsigned int n)
+{
+    tcflag_t bn = map_n_to_bn(n);
+
+    if (n != 0 && bn == B0)
+        bn = BOTHER;
+    tio->c_cflag &= ~((tcflag_t)CBAUD << shift);
+    tio->c_cflag |= bn << shift;
+    *speed = n;
+}
+
+static int
+set_termios(struct sim_port *port, const tio_t *new)
+{
+    const struct serial_struct *ser = &port->ser;
+    tio_t tio = *new;
+    unsigned int output, input;
+
+    output = decode_rate(&tio, 0, tio.c_ospeed);
+#ifdef IBSHIFT
+    input = decode_rate(&tio, IBSHIFT, tio.c_ispeed);
+#else
+    input = output;
+#endif
+    if (output == BAUDRATE_UNKNOWN || input == BAUDRATE_UNKNOWN) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* B38400 aliased by ASYNC_SPD_CUST is produced exactly by divisor */
+    if ((tio.c_cflag & CBAUD) == B38400 && config.baud_base &&
+        (ser->flags & ASYNC_SPD_MASK) == ASYNC_SPD_CUST && ser->custom_divisor)
+        tio.c_ospeed = divisor_rate(config.baud_base, ser->custom_divisor);
+    else
+        encode_rate(&tio, 0, &tio.c_ospeed, round_rate(output));
+
+#ifdef IBSHIFT
+    /* B0 input means input baud rate follows output */
+    if (((tio.c_cflag >> IBSHIFT) & CBAUD) == B0)
+        tio.c_ispeed = tio.c_ospeed;
+    else
+        encode_rate(&tio, IBSHIFT, &tio.c_ispeed, round_rate(input));
+#else
+    tio.c_ispeed = tio.c_ospeed;
+#endif
+
+    port->tio = tio;
+    return 0;
+}
+#else
+/* Without BOTHER only Bnnn constants can be requested and termios has no
+   field for rate which driver really uses, so it is stored as is */
+static int
+set_termios(struct sim_port *port, const tio_t *new)
+{
+    if (map_bn_to_n(new->c_cflag & CBAUD) == BAUDRATE_UNKNOWN) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    port->tio = *new;
+    return 0;
+}
+#endif
+
+static int
+set_serial(struct sim_port *port, const struct serial_struct *new)
+{
+    if (new->custom_divisor < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* Only flags and divisor can be changed, baud_base is a property of
+       simulated hardware */
+    port->ser.flags = new->flags;
+    port->ser.custom_divisor = new->custom_divisor;
+    return 0;
+}
+
+static int
+set_rs485(struct sim_port *port, struct serial_rs485 *new)
+{
+    /* Kernel clamps delays and returns what it used */
+    if (new->delay_rts_before_send > SIM_MAX_RTS_DELAY)
+        new->delay_rts_before_send = SIM_MAX_RTS_DELAY;
+    if (new->delay_rts_after_send > SIM_MAX_RTS_DELAY)
+        new->delay_rts_after_send = SIM_MAX_RTS_DELAY;
+    port->rs485 = *new;
+    return 0;
+}
+
+static int
+sim_ioctl(void *ctx, int fd, unsigned long request, void *arg)
+{
+    struct timespec delay;
+    struct sim_port *port;
+    int rc = 0;
+
+    (void)ctx;
+
+    /* Latency is outside of the lock, so ports are simulated in parallel */
+    if (config.latency_us) {
+        delay.tv_sec = config.latency_us / 1000000;
+        delay.tv_nsec = (config.latency_us % 1000000) * 1000L;
+        nanosleep(&delay, NULL);
+    }
+
+    pthread_mutex_lock(&lock);
+    port = fd >= 0 && (size_t)fd < nports ? &ports[fd] : NULL;
+    if (!port || !port->used) {
+        pthread_mutex_unlock(&lock);
+        errno = EBADF;
+        return -1;
+    }
+
+    switch (request) {
+#ifdef TCGETS2
+    case TCGETS2:
+#else
+    case TCGETS:
+#endif
+        memcpy(arg, &port->tio, sizeof(port->tio));
+        break;
+#ifdef TCSETS2
+    case TCSETS2:
+    case TCSETSW2:
+    case TCSETSF2:
+#else
+    case TCSETS:
+    case TCSETSW:
+    case TCSETSF:
+#endif
+        rc = set_termios(port, arg);
+        break;
+    case TIOCGSERIAL:
+    case TIOCSSERIAL:
+        if (!config.baud_base) {
+            errno = ENOTTY;
+            rc = -1;
+        } else if (request == TIOCGSERIAL) {
+            memcpy(arg, &port->ser, sizeof(port->ser));
+        } else {
+            rc = set_serial(port, arg);
+        }
+        break;
+    case TIOCGRS485:
+        memcpy(arg, &port->rs485, sizeof(port->rs485));
+        break;
+    case TIOCSRS485:
+        rc = set_rs485(port, arg);
+        break;
+    case TCFLSH:
+        /* Simulated port never has pending data, queue is still checked */
+        if ((unsigned long)arg > TCIOFLUSH) {
+            errno = EINVAL;
+            rc = -1;
+        }
+        break;
+    case TIOCGICOUNT:
+        /* Simulated line never has errors */
+        memset(arg, 0, sizeof(struct serial_icounter_struct));
+        break;
+    default:
+        errno = ENOTTY;
+        rc = -1;
+        break;
+    }
+
+    pthread_mutex_unlock(&lock);
+    return rc;
+}
+
+int
+sim_parse(const char *spec, struct sim_config *cfg)
+{
+    const char *p = spec, *rest;
+    unsigned long val;
+    char *end;
+
+    memset(cfg, 0, sizeof(*cfg));
+
+    while (*p) {
+        if (strncmp(p, "base=", 5) == 0) {
+            val = strtoul(p + 5, &end, 10);
+            if (end == p + 5 || val > 0x7fffffff)
+                return -1;
+            cfg->baud_base = val;
+            rest = end;
+        } else if (strncmp(p, "latency=", 8) == 0) {
+            val = strtoul(p + 8, &end, 10);
+            if (end == p + 8 || val > 0xffffffff)
+                return -1;
+            cfg->latency_us = val;
+            rest = end;
+        } else if (strncmp(p, "round=exact", 11) == 0) {
+            cfg->round = SIM_ROUND_EXACT;
+            rest = p + 11;
+        } else if (strncmp(p, "round=divisor", 13) == 0) {
+            cfg->round = SIM_ROUND_DIVISOR;
+            rest = p + 13;
+        } else if (strncmp(p, "round=standard", 14) == 0) {
+            cfg->round = SIM_ROUND_STANDARD;
+            rest = p + 14;
+        } else {
+            return -1;
+        }
+        if (*rest == ',' && rest[1])
+            rest++;
+        else if (*rest)
+            return -1;
+        p = rest;
+    }
+
+    /* Divisor rounding needs UART clock */
+    if (cfg->round == SIM_ROUND_DIVISOR && !cfg->baud_base)
+        return -1;
+
+    return 0;
+}
+
+void
+sim_enable(const struct sim_config *cfg)
+{
+    config = *cfg;
+    baudrate_set_backend(sim_ioctl, NULL);
+}
+
+int
+sim_open(void)
+{
+    struct sim_port *port;
+    size_t size;
+    int fd, err;
+
+    /* Every port needs a distinct fd which can be closed as usual */
+    fd = open("/dev/null", O_RDWR);
+    if (fd < 0)
+        return -1;
+
+    pthread_mutex_lock(&lock);
+    if ((size_t)fd >= nports) {
+        size = nports ? nports : 16;
+        while (size <= (size_t)fd)
+            size *= 2;
+        port = realloc(ports, size * sizeof(*ports));
+        if (!port) {
+            err = errno;
+            pthread_mutex_unlock(&lock);
+            close(fd);
+            errno = err;
+            return -1;
+        }
+        memset(port + nports, 0, (size - nports) * sizeof(*ports));
+        ports = port;
+        nports = size;
+    }
+
+    /* Defaults of kernel tty_std_termios and of 16550A UART */
+    port = &ports[fd];
+    memset(port, 0, sizeof(*port));
+    port->used = 1;
+    port->tio.c_iflag = ICRNL | IXON;
+    port->tio.c_oflag = OPOST | ONLCR;
+    port->tio.c_cflag = B38400 | CS8 | CREAD | HUPCL;
+    port->tio.c_lflag = ISIG | ICANON | ECHO | ECHOE | ECHOK | ECHOCTL |
+                        ECHOKE | IEXTEN;
+    port->tio.c_cc[VMIN] = 1;
+#ifdef TCGETS2
+    port->tio.c_ispeed = 38400;
+    port->tio.c_ospeed = 38400;
+#endif
+    port->ser.type = PORT_16550A;
+    port->ser.baud_base = config.baud_base;
+    port->ser.xmit_fifo_size = 16;
+    /* Driver reports rate it really uses already after open */
+    set_termios(port, &port->tio);
+    pthread_mutex_unlock(&lock);
+
+    return fd;
+}
@@ -0,0 +1,30 @@
+/* SPDX-FileCopyrightText: 2021 Pali Rohár <pali@kernel.org> */
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+#ifndef SIM_H
+#define SIM_H
+
+/* How simulated driver changes requested baud rate */
+#define SIM_ROUND_EXACT 0 /* any baud rate is used as is, like pty */
+#define SIM_ROUND_DIVISOR 1 /* baud_base divided by closest 16-bit divisor */
+#define SIM_ROUND_STANDARD 2 /* closest baud rate with Bnnn constant */
+
+/* Model of simulated driver, same for all ports */
+struct sim_config {
+    unsigned int baud_base; /* 0 when TIOCGSERIAL is unsupported */
+    int round; /* SIM_ROUND_* */
+    unsigned int latency_us; /* added to every ioctl */
+};
+
+/* Parse comma separated base=n, round=exact|divisor|standard and
+   latency=us into cfg, return 0 or -1 */
+int sim_parse(const char *spec, struct sim_config *cfg);
+
+/* Route library ioctls to simulated driver */
+void sim_enable(const struct sim_config *cfg);
+
+/* Open new simulated port with default settings, return fd or -1 with
+   errno. Its state is dropped when the fd number is opened again */
+int sim_open(void);
+
+#endif
@@ -0,0 +1,292 @@
+/* SPDX-FileCopyrightText: 2021 Pali Rohár <pali@kernel.org> */
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+#define _DEFAULT_SOURCE /* for flock(), realpath(), readlink(), major(), minor() */
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h> /* for open() */
+#include <unistd.h> /* for read(), close(), ftruncate(), access() */
+#include <sys/file.h> /* for flock() */
+#include <sys/mman.h> /* for mmap() */
+#include <sys/stat.h> /* for stat() */
+#include <sys/sysmacros.h> /* for major(), minor() */
+
+#include "state.h"
+
+int
+state_open(struct state *st, const char *path)
+{
+    struct state_file *map;
+    struct stat sb;
+    int fd, err;
+
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return -1;
+
+    /* Other udev workers may create the same file at the same time */
+    if (flock(fd, LOCK_EX) || fstat(fd, &sb))
+        goto fail;
+    if (sb.st_size == 0 && ftruncate(fd, sizeof(*map)))
+        goto fail;
+    if (sb.st_size != 0 && sb.st_size != sizeof(*map)) {
+        errno = EINVAL;
+        goto fail;
+    }
+
+    map = mmap(NULL, sizeof(*map), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+        goto fail;
+
+    if (sb.st_size == 0) {
+        map->magic = STATE_MAGIC;
+        map->version = STATE_VERSION;
+    } else if (map->magic != STATE_MAGIC || map->version != STATE_VERSION ||
+               map->count > STATE_MAX_ENTRIES || map->ncaps > STATE_MAX_CAPS) {
+        munmap(map, sizeof(*map));
+        errno = EINVAL;
+        goto fail;
+    }
+
+    flock(fd, LOCK_UN);
+    st->fd = fd;
+    st->map = map;
+    return 0;
+
+fail:
+    err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+}
+
+void
+state_close(struct state *st)
+{
+    munmap(st->map, sizeof(*st->map));
+    close(st->fd);
+}
+
+/* Read sysfs attribute without trailing newline */
+static int
+read_attr(const char *dir, const char *name, char *buf, size_t size)
+{
+    char path[PATH_MAX + 32];
+    ssize_t len;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    len = read(fd, buf, size - 1);
+    close(fd);
+    if (len <= 0)
+        return -1;
+
+    while (len > 0 && (buf[len-1] == '\n' || buf[len-1] == ' '))
+        len--;
+    buf[len] = '\0';
+    return 0;
+}
+
+/* Check whether sysfs attribute exists */
+static int
+access_attr(const char *dir, const char *name)
+{
+    char path[PATH_MAX + 32];
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    return access(path, F_OK) == 0;
+}
+
+/* Path of sysfs device directory of tty device dev */
+static int
+device_dir(const char *dev, char *dir)
+{
+    char path[64];
+    struct stat sb;
+
+    if (stat(dev, &sb) || !S_ISCHR(sb.st_mode))
+        return -1;
+
+    snprintf(path, sizeof(path), "/sys/dev/char/%u:%u/device",
+             major(sb.st_rdev), minor(sb.st_rdev));
+    return realpath(path, dir) ? 0 : -1;
+}
+
+void
+state_key(const char *dev, char *key, size_t size)
+{
+    char dir[PATH_MAX], serial[64], busnum[8], devpath[32], ifnum[8] = "";
+    char *slash;
+
+    snprintf(key, size, "%s", dev);
+    if (device_dir(dev, dir))
+        return;
+
+    /* Walk up to USB device which owns the tty interface, remembering
+       interface of multi-port chips. Hubs above it have serial too, e.g.
+       root hub has PCI address of controller, so walk stops there */
+    while (strcmp(dir, "/sys/devices") != 0) {
+        if (!ifnum[0])
+            read_attr(dir, "bInterfaceNumber", ifnum, sizeof(ifnum));
+        if (access_attr(dir, "idVendor")) {
+            if (read_attr(dir, "serial", serial, sizeof(serial)) == 0)
+                snprintf(key, size, "usb:%s:%s", serial, ifnum);
+            /* Without iSerial, e.g. CH340, port of hub tree identifies it */
+            else if (read_attr(dir, "busnum", busnum, sizeof(busnum)) == 0 &&
+                     read_attr(dir, "devpath", devpath, sizeof(devpath)) == 0)
+                snprintf(key, size, "usb-port:%s-%s:%s", busnum, devpath, ifnum);
+            return;
+        }
+        slash = strrchr(dir, '/');
+        if (!slash || slash == dir)
+            return;
+        *slash = '\0';
+    }
+}
+
+int
+state_caps_key(const char *dev, char *key, size_t size)
+{
+    char dir[PATH_MAX], path[PATH_MAX + 8], link[256];
+    char vendor[8], product[8], *driver, *slash;
+    ssize_t len;
+
+    if (device_dir(dev, dir))
+        return -1;
+
+    snprintf(path, sizeof(path), "%s/driver", dir);
+    len = readlink(path, link, sizeof(link) - 1);
+    if (len <= 0)
+        return -1;
+    link[len] = '\0';
+    slash = strrchr(link, '/');
+    driver = slash ? slash + 1 : link;
+    snprintf(key, size, "%s", driver);
+
+    /* USB chips with the same driver may still differ */
+    while (strcmp(dir, "/sys/devices") != 0) {
+        if (read_attr(dir, "idVendor", vendor, sizeof(vendor)) == 0 &&
+            read_attr(dir, "idProduct", product, sizeof(product)) == 0) {
+            snprintf(key, size, "%s:%s:%s", driver, vendor, product);
+            break;
+        }
+        slash = strrchr(dir, '/');
+        if (!slash || slash == dir)
+            break;
+        *slash = '\0';
+    }
+
+    return 0;
+}
+
+static struct state_entry *
+find_entry(struct state_file *map, const char *key)
+{
+    uint32_t i;
+
+    for (i = 0; i < map->count; i++) {
+        if (strncmp(map->entries[i].key, key, STATE_KEY_SIZE) == 0)
+            return &map->entries[i];
+    }
+
+    return NULL;
+}
+
+int
+state_lookup(struct state *st, const char *key, struct state_entry *entry)
+{
+    const struct state_entry *found;
+
+    flock(st->fd, LOCK_SH);
+    found = find_entry(st->map, key);
+    if (found)
+        *entry = *found;
+    flock(st->fd, LOCK_UN);
+
+    return found ? 0 : -1;
+}
+
+int
+state_store(struct state *st, const struct state_entry *entry)
+{
+    struct state_file *map = st->map;
+    struct state_entry *found;
+    int rc = 0;
+
+    if (flock(st->fd, LOCK_EX))
+        return -1;
+
+    found = find_entry(map, entry->key);
+    if (!found && map->count < STATE_MAX_ENTRIES)
+        found = &map->entries[map->count++];
+
+    if (found) {
+        *found = *entry;
+    } else {
+        errno = ENOSPC;
+        rc = -1;
+    }
+
+    flock(st->fd, LOCK_UN);
+    return rc;
+}
+
+static struct state_caps *
+find_caps(struct state_file *map, const char *key)
+{
+    uint32_t i;
+
+    for (i = 0; i < map->ncaps; i++) {
+        if (strncmp(map->caps[i].key, key, STATE_KEY_SIZE) == 0)
+            return &map->caps[i];
+    }
+
+    return NULL;
+}
+
+int
+state_caps_lookup(struct state *st, const char *key, struct state_caps *caps)
+{
+    const struct state_caps *found;
+
+    flock(st->fd, LOCK_SH);
+    found = find_caps(st->map, key);
+    if (found)
+        *caps = *found;
+    flock(st->fd, LOCK_UN);
+
+    return found ? 0 : -1;
+}
+
+int
+state_caps_store(struct state *st, const struct state_caps *caps)
+{
+    struct state_file *map = st->map;
+    struct state_caps *found;
+    int rc = 0;
+
+    if (flock(st->fd, LOCK_EX))
+        return -1;
+
+    found = find_caps(map, caps->key);
+    if (!found && map->ncaps < STATE_MAX_CAPS)
+        found = &map->caps[map->ncaps++];
+
+    if (found) {
+        *found = *caps;
+    } else {
+        errno = ENOSPC;
+        rc = -1;
+    }
+
+    flock(st->fd, LOCK_UN);
+    return rc;
+}
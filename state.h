@@ -0,0 +1,82 @@
+/* SPDX-FileCopyrightText: 2021 Pali Rohár <pali@kernel.org> */
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+#ifndef STATE_H
+#define STATE_H
+
+#include <stddef.h> /* for size_t */
+#include <stdint.h> /* for uint32_t */
+
+/* Identification of state file and its layout */
+#define STATE_MAGIC 0x54534442 /* "BDST" */
+#define STATE_VERSION 3
+
+/* Fixed number of entries, so file can be mapped without resizing */
+#define STATE_MAX_ENTRIES 256
+#define STATE_MAX_CAPS 64
+
+/* Room for "usb:" prefix, serial number and interface or device path */
+#define STATE_KEY_SIZE 112
+
+/* Last settings of one port */
+struct state_entry {
+    char key[STATE_KEY_SIZE]; /* empty for unused entry */
+    uint32_t output; /* last requested baud rates */
+    uint32_t input;
+    uint32_t cur_output; /* last baud rates read back from driver */
+    uint32_t cur_input;
+};
+
+/* Capabilities probed by --probe, shared by ports of the same driver and
+   device model */
+struct state_caps {
+    char key[STATE_KEY_SIZE]; /* driver and USB vendor:product id */
+    uint64_t standard;
+    int32_t bother;
+    int32_t split;
+    uint32_t baud_base;
+    uint32_t min_divisor_rate;
+    uint64_t standard_exact;
+};
+
+/* Layout of the whole state file in native byte order */
+struct state_file {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t count; /* number of used entries */
+    uint32_t ncaps; /* number of used caps */
+    struct state_entry entries[STATE_MAX_ENTRIES];
+    struct state_caps caps[STATE_MAX_CAPS];
+};
+
+/* Opened and mapped state file */
+struct state {
+    int fd;
+    struct state_file *map;
+};
+
+/* Open or create state file and map it, return 0 or -1 with errno */
+int state_open(struct state *st, const char *path);
+
+void state_close(struct state *st);
+
+/* Fill key identifying port dev across hotplug, which is USB serial number
+   with interface number, USB bus and port path for devices without serial
+   number, or device path otherwise */
+void state_key(const char *dev, char *key, size_t size);
+
+/* Fill key identifying driver and device model of port dev, return -1 when
+   port is not bound to any driver, e.g. pty */
+int state_caps_key(const char *dev, char *key, size_t size);
+
+/* Copy entry of key into entry, return 0 when found or -1 */
+int state_lookup(struct state *st, const char *key, struct state_entry *entry);
+
+/* Add or replace entry of key, return 0 or -1 with errno */
+int state_store(struct state *st, const struct state_entry *entry);
+
+/* Same for caps */
+int state_caps_lookup(struct state *st, const char *key, struct state_caps *caps);
+int state_caps_store(struct state *st, const struct state_caps *caps);
+
+#endif
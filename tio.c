@@ -0,0 +1,69 @@
+/* SPDX-FileCopyrightText: 2021 Pali Rohár <pali@kernel.org> */
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+#define _POSIX_C_SOURCE 200809L /* for clock_gettime() */
+
+#include <time.h>
+
+#include "baudrate.h"
+#include "tio.h"
+
+/* Library ioctls are traced and use simulated driver when it is installed */
+int
+tio_get(int fd, tio_t *tio)
+{
+    return baudrate_get_termios(fd, tio);
+}
+
+int
+tio_set(int fd, const tio_t *tio)
+{
+    return baudrate_set_termios(fd, BAUDRATE_NOW, tio);
+}
+
+int
+tio_set_raw(int fd, tio_t *saved)
+{
+    tio_t tio;
+
+    if (tio_get(fd, saved))
+        return -1;
+
+    tio = *saved;
+    tio.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR |
+                     ICRNL | IXON | IXOFF | IXANY);
+    tio.c_oflag &= ~OPOST;
+    tio.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
+    tio.c_cflag |= CREAD | CLOCAL;
+    tio.c_cc[VMIN] = 0;
+    tio.c_cc[VTIME] = 0;
+    if (tio_set(fd, &tio))
+        return -1;
+
+    /* Drop stale data which would be mixed with new one */
+    return baudrate_flush(fd, TCIOFLUSH);
+}
+
+unsigned char
+tio_data_mask(const tio_t *tio)
+{
+    switch (tio->c_cflag & CSIZE) {
+    case CS5:
+        return 0x1f;
+    case CS6:
+        return 0x3f;
+    case CS7:
+        return 0x7f;
+    default:
+        return 0xff;
+    }
+}
+
+double
+tio_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
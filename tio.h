@@ -0,0 +1,31 @@
+/* SPDX-FileCopyrightText: 2021 Pali Rohár <pali@kernel.org> */
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+#ifndef TIO_H
+#define TIO_H
+
+#include <asm/ioctls.h> /* for TCGETS2 */
+#include <asm/termbits.h> /* for struct termios, struct termios2 */
+
+/* Type of tio structure depends on supported ioctl */
+#ifdef TCGETS2
+typedef struct termios2 tio_t;
+#else
+typedef struct termios tio_t;
+#endif
+
+/* Get or set tio structure via supported ioctl */
+int tio_get(int fd, tio_t *tio);
+int tio_set(int fd, const tio_t *tio);
+
+/* Switch port to raw mode without touching baud rate and character format
+   and flush pending data, previous settings are stored into saved */
+int tio_set_raw(int fd, tio_t *saved);
+
+/* Mask of data bits in one character */
+unsigned char tio_data_mask(const tio_t *tio);
+
+/* Current CLOCK_MONOTONIC time in seconds */
+double tio_now(void);
+
+#endif
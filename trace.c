@@ -0,0 +1,247 @@
+/* SPDX-FileCopyrightText: 2021 Pali Rohár <pali@kernel.org> */
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+#define _DEFAULT_SOURCE /* for readlink(), major(), minor() */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h> /* for pthread_mutex_*() */
+#include <unistd.h> /* for readlink() */
+#include <sys/stat.h> /* for fstat() */
+#include <sys/sysmacros.h> /* for major(), minor() */
+
+#include "trace.h"
+
+/* Four buckets per power of two nanoseconds, so percentiles are reported
+   with at most 25% error without keeping all samples */
+#define SUB_BUCKETS 4
+#define BUCKETS (64 * SUB_BUCKETS)
+
+struct hist {
+    unsigned long count;
+    unsigned long buckets[BUCKETS];
+};
+
+struct driver {
+    char name[32];
+    struct hist hist[BAUDRATE_TRACE_OPS];
+};
+
+struct attachment {
+    int fd;
+    struct trace_device *dev;
+    size_t driver;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct attachment *attachments;
+static size_t nattachments, aattachments;
+static struct driver *drivers;
+static size_t ndrivers, adrivers;
+
+static size_t
+bucket(double seconds)
+{
+    unsigned long long ns = seconds > 0 ? seconds * 1e9 : 0;
+    unsigned int e = 0;
+
+    if (ns < SUB_BUCKETS)
+        return ns;
+
+    /* Exponent and two bits following the leading one */
+    while ((ns >> e) >= 2 * SUB_BUCKETS)
+        e++;
+    return (e + 1) * SUB_BUCKETS + (ns >> e) - SUB_BUCKETS;
+}
+
+/* Upper bound of bucket in microseconds */
+static double
+bucket_limit(size_t i)
+{
+    unsigned int e, sub;
+
+    if (i < SUB_BUCKETS)
+        return (i + 1) / 1e3;
+
+    e = i / SUB_BUCKETS - 1;
+    sub = i % SUB_BUCKETS;
+    return (double)((SUB_BUCKETS + sub + 1ULL) << e) / 1e3;
+}
+
+static double
+percentile(const struct hist *h, double q)
+{
+    unsigned long rank = h->count * q, seen = 0;
+    size_t i;
+
+    if (rank >= h->count)
+        rank = h->count - 1;
+    for (i = 0; i < BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen > rank)
+            break;
+    }
+
+    return bucket_limit(i < BUCKETS ? i : BUCKETS - 1);
+}
+
+static void
+trace_cb(void *ctx, int fd, int op, double seconds, int rc)
+{
+    struct attachment *a;
+    struct hist *h;
+    size_t i;
+
+    (void)ctx;
+    (void)rc; /* failed ioctls take time too */
+
+    if (op < 0 || op >= BAUDRATE_TRACE_OPS)
+        return;
+
+    pthread_mutex_lock(&lock);
+    for (i = 0; i < nattachments; i++) {
+        a = &attachments[i];
+        if (a->fd != fd)
+            continue;
+        if (a->dev) {
+            a->dev->count[op]++;
+            a->dev->total[op] += seconds;
+        }
+        h = &drivers[a->driver].hist[op];
+        h->count++;
+        h->buckets[bucket(seconds)]++;
+        break;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void
+trace_enable(void)
+{
+    baudrate_set_trace(trace_cb, NULL);
+}
+
+/* Name of kernel driver bound to tty device */
+static void
+driver_name(int fd, char *name, size_t size)
+{
+    char path[64], link[256], *base;
+    struct stat sb;
+    ssize_t len;
+
+    snprintf(name, size, "unknown");
+    if (fstat(fd, &sb) || !S_ISCHR(sb.st_mode))
+        return;
+
+    snprintf(path, sizeof(path), "/sys/dev/char/%u:%u/device/driver",
+             major(sb.st_rdev), minor(sb.st_rdev));
+    len = readlink(path, link, sizeof(link) - 1);
+    if (len <= 0)
+        return;
+    link[len] = '\0';
+
+    base = strrchr(link, '/');
+    base = base ? base + 1 : link;
+
+    /* Truncated name could merge statistics of different drivers */
+    if (strlen(base) < size)
+        snprintf(name, size, "%.*s", (int)(size - 1), base);
+}
+
+int
+trace_attach(int fd, struct trace_device *dev)
+{
+    struct attachment *a;
+    char name[32];
+    size_t i;
+    void *p;
+    int rc = -1;
+
+    /* Reading sysfs is slow, do not hold lock for it */
+    driver_name(fd, name, sizeof(name));
+
+    pthread_mutex_lock(&lock);
+
+    for (i = 0; i < ndrivers; i++) {
+        if (strcmp(drivers[i].name, name) == 0)
+            break;
+    }
+    if (i == ndrivers) {
+        if (ndrivers == adrivers) {
+            p = realloc(drivers, (adrivers ? adrivers * 2 : 4) * sizeof(*drivers));
+            if (!p)
+                goto out;
+            drivers = p;
+            adrivers = adrivers ? adrivers * 2 : 4;
+        }
+        memset(&drivers[ndrivers], 0, sizeof(*drivers));
+        snprintf(drivers[ndrivers].name, sizeof(drivers[ndrivers].name),
+                 "%s", name);
+        ndrivers++;
+    }
+
+    if (nattachments == aattachments) {
+        p = realloc(attachments,
+                    (aattachments ? aattachments * 2 : 16) * sizeof(*attachments));
+        if (!p)
+            goto out;
+        attachments = p;
+        aattachments = aattachments ? aattachments * 2 : 16;
+    }
+    a = &attachments[nattachments++];
+    a->fd = fd;
+    a->dev = dev;
+    a->driver = i;
+    rc = 0;
+
+out:
+    pthread_mutex_unlock(&lock);
+    if (rc)
+        errno = ENOMEM;
+    return rc;
+}
+
+void
+trace_detach(int fd)
+{
+    size_t i;
+
+    pthread_mutex_lock(&lock);
+    for (i = 0; i < nattachments; i++) {
+        if (attachments[i].fd == fd) {
+            attachments[i] = attachments[--nattachments];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+int
+trace_summary(size_t index, struct trace_summary *sum)
+{
+    const struct hist *h;
+    size_t i;
+    int op;
+
+    pthread_mutex_lock(&lock);
+    for (i = 0; i < ndrivers; i++) {
+        for (op = 0; op < BAUDRATE_TRACE_OPS; op++) {
+            h = &drivers[i].hist[op];
+            if (!h->count || index--)
+                continue;
+            sum->driver = drivers[i].name;
+            sum->op = op;
+            sum->count = h->count;
+            sum->p50 = percentile(h, 0.5);
+            sum->p99 = percentile(h, 0.99);
+            pthread_mutex_unlock(&lock);
+            return 0;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+
+    return -1;
+}
@@ -0,0 +1,39 @@
+/* SPDX-FileCopyrightText: 2021 Pali Rohár <pali@kernel.org> */
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h> /* for size_t */
+
+#include "baudrate.h"
+
+/* Timing of library ioctls issued on one device */
+struct trace_device {
+    unsigned int count[BAUDRATE_TRACE_OPS];
+    double total[BAUDRATE_TRACE_OPS]; /* seconds */
+};
+
+/* Aggregated timing of one ioctl of one driver */
+struct trace_summary {
+    const char *driver; /* valid until trace_attach() is called again */
+    int op;
+    unsigned long count;
+    double p50; /* microseconds, upper bound of histogram bucket */
+    double p99;
+};
+
+/* Install library trace callback */
+void trace_enable(void);
+
+/* Account ioctls issued on fd to dev and to histogram of driver of fd, dev
+   may be NULL. Return 0 or -1 with errno */
+int trace_attach(int fd, struct trace_device *dev);
+
+/* Stop accounting of fd, it has to be called before fd is closed */
+void trace_detach(int fd);
+
+/* Fill summary of index-th non-empty histogram, return -1 past the end */
+int trace_summary(size_t index, struct trace_summary *sum);
+
+#endif
@@ -0,0 +1,136 @@
+/* SPDX-FileCopyrightText: 2021 Pali Rohár <pali@kernel.org> */
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+#define _POSIX_C_SOURCE 200809L /* for O_CLOEXEC */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h> /* for open() */
+#include <unistd.h> /* for write(), close() */
+
+#include "baudrate.h"
+#include "udev.h"
+
+/* Line buffer filled by append_*() and written by one write() call */
+struct line {
+    char buf[512];
+    size_t len;
+};
+
+static void
+append_str(struct line *l, const char *str)
+{
+    size_t len = strlen(str);
+
+    if (len > sizeof(l->buf) - l->len)
+        len = sizeof(l->buf) - l->len;
+    memcpy(l->buf + l->len, str, len);
+    l->len += len;
+}
+
+static void
+append_rate(struct line *l, unsigned int n)
+{
+    char buf[16], *p = buf + sizeof(buf);
+
+    if (n == BAUDRATE_UNKNOWN) {
+        append_str(l, "unknown");
+        return;
+    }
+
+    *--p = '\0';
+    do {
+        *--p = '0' + n % 10;
+        n /= 10;
+    } while (n);
+    append_str(l, p);
+}
+
+static void
+flush_line(struct line *l, int fd)
+{
+    append_str(l, "\n");
+    if (l->len == sizeof(l->buf))
+        l->buf[l->len-1] = '\n';
+    (void)!write(fd, l->buf, l->len);
+    l->len = 0;
+}
+
+static int
+fail(const char *dev, const char *op, int err)
+{
+    struct line l = { .len = 0 };
+
+    append_str(&l, "baudrate: ");
+    append_str(&l, dev);
+    append_str(&l, ": ");
+    append_str(&l, op);
+    if (err) {
+        append_str(&l, ": ");
+        append_str(&l, strerror(err));
+    }
+    flush_line(&l, STDERR_FILENO);
+    return EXIT_FAILURE;
+}
+
+/* Parse baud rate, return pointer after it or NULL */
+static const char *
+parse_rate(const char *str, unsigned int *n)
+{
+    unsigned long val = 0;
+
+    if (*str < '0' || *str > '9')
+        return NULL;
+    while (*str >= '0' && *str <= '9') {
+        val = val * 10 + (*str++ - '0');
+        if (val >= BAUDRATE_UNKNOWN)
+            return NULL;
+    }
+
+    *n = val;
+    return str;
+}
+
+int
+udev_main(void)
+{
+    unsigned int output, input, cur_output, cur_input;
+    const char *dev, *rate, *end;
+    struct line l = { .len = 0 };
+    int fd;
+
+    dev = getenv("DEVNAME");
+    if (!dev || !*dev)
+        return fail("udev", "DEVNAME is not set", 0);
+
+    rate = getenv("BAUDRATE");
+    if (!rate || !*rate)
+        return fail(dev, "BAUDRATE is not set", 0);
+
+    end = parse_rate(rate, &output);
+    input = output;
+    if (end && *end == ':')
+        end = parse_rate(end + 1, &input);
+    if (!end || *end)
+        return fail(dev, "invalid BAUDRATE", 0);
+
+    fd = open(dev, O_RDWR | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
+    if (fd < 0)
+        return fail(dev, "open", errno);
+
+    if (baudrate_change(fd, output, input, &cur_output, &cur_input)) {
+        close(fd);
+        return fail(dev, "set baud rate", errno);
+    }
+    close(fd);
+
+    append_str(&l, dev);
+    append_str(&l, ": output baud rate: ");
+    append_rate(&l, cur_output);
+    append_str(&l, ", input baud rate: ");
+    append_rate(&l, cur_input);
+    flush_line(&l, STDOUT_FILENO);
+    return EXIT_SUCCESS;
+}
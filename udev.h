@@ -0,0 +1,15 @@
+/* SPDX-FileCopyrightText: 2021 Pali Rohár <pali@kernel.org> */
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+#ifndef UDEV_H
+#define UDEV_H
+
+/*
+ * Configure device from udev RUN+= rule. Device is taken from DEVNAME and
+ * baud rate in output[:input] format from BAUDRATE environment variable,
+ * e.g. ENV{BAUDRATE}="115200". No stdio is used so startup of statically
+ * linked binary stays cheap. Return exit status.
+ */
+int udev_main(void);
+
+#endif